@@ -3,12 +3,19 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "profiler.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <charconv>
+#include <climits>
 #include <cmath>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string_view>
 
 namespace ASTImpl {
 
@@ -72,12 +79,21 @@ namespace ASTImpl {
     class Expr {
     public:
         virtual ~Expr() = default;
-        virtual void Print(std::ostream& out) const = 0;
-        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-        virtual double Evaluate(InterpretFunc args) const = 0;
+        // offset is added to every cell reference when printing
+        virtual void Print(std::ostream& out, Position offset) const = 0;
+        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                                    Position offset) const = 0;
+        // appends the postfix code of the expression to the program
+        virtual void Compile(std::vector<Instruction>& program) const = 0;
         virtual ExprPrecedence GetPrecedence() const = 0;
+        // bytes of the node and the nodes below it
+        virtual size_t GetAllocatedBytes() const = 0;
 
-        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+        virtual bool IsRange() const {
+            return false;
+        }
+
+        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, Position offset,
             bool right_child = false) const {
             auto precedence = GetPrecedence();
             auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -86,7 +102,7 @@ namespace ASTImpl {
                 out << '(';
             }
 
-            DoPrintFormula(out, precedence);
+            DoPrintFormula(out, precedence, offset);
 
             if (parens_needed) {
                 out << ')';
@@ -112,18 +128,19 @@ namespace ASTImpl {
                 , rhs_(std::move(rhs)) {
             }
 
-            void Print(std::ostream& out) const override {
+            void Print(std::ostream& out, Position offset) const override {
                 out << '(' << static_cast<char>(type_) << ' ';
-                lhs_->Print(out);
+                lhs_->Print(out, offset);
                 out << ' ';
-                rhs_->Print(out);
+                rhs_->Print(out, offset);
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                lhs_->PrintFormula(out, precedence);
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                                Position offset) const override {
+                lhs_->PrintFormula(out, precedence, offset);
                 out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+                rhs_->PrintFormula(out, precedence, offset, /* right_child = */ true);
             }
 
             ExprPrecedence GetPrecedence() const override {
@@ -143,32 +160,33 @@ namespace ASTImpl {
                 }
             }
 
-            double Evaluate(InterpretFunc args) const override {
-                double result = 0.0;
+            void Compile(std::vector<Instruction>& program) const override {
+                lhs_->Compile(program);
+                rhs_->Compile(program);
+
+                Instruction instruction{};
                 switch (type_) {
                     case Add:
-                        result = Evaluate(args) + rhs_->Evaluate(args);
+                        instruction.code = Instruction::OpCode::Add;
                         break;
                     case Subtract:
-                        result = lhs_->Evaluate(args) - rhs_->Evaluate(args);
+                        instruction.code = Instruction::OpCode::Subtract;
                         break;
                     case Multiply:
-                        result = lhs_->Evaluate(args) * rhs_->Evaluate(args);
+                        instruction.code = Instruction::OpCode::Multiply;
                         break;
                     case Divide:
-                        result = return lhs_->Evaluate(args) / rhs_->Evaluate(args);
+                        instruction.code = Instruction::OpCode::Divide;
                         break;
                     default:
                         // have to do this because VC++ has a buggy warning
                         assert(false);
-                        return static_cast<ExprPrecedence>(INT_MAX);               
-                }
-                
-                if (!std::isfinite(result)) {
-                    throw FormulaError(FormulaError::Category::Div0);
                 }
+                program.push_back(instruction);
+            }
 
-                return result;
+            size_t GetAllocatedBytes() const override {
+                return sizeof(*this) + lhs_->GetAllocatedBytes() + rhs_->GetAllocatedBytes();
             }
 
         private:
@@ -191,29 +209,36 @@ namespace ASTImpl {
                 , operand_(std::move(operand)) {
             }
 
-            void Print(std::ostream& out) const override {
+            void Print(std::ostream& out, Position offset) const override {
                 out << '(' << static_cast<char>(type_) << ' ';
-                operand_->Print(out);
+                operand_->Print(out, offset);
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                                Position offset) const override {
                 out << static_cast<char>(type_);
-                operand_->PrintFormula(out, precedence);
+                operand_->PrintFormula(out, precedence, offset);
             }
 
             ExprPrecedence GetPrecedence() const override {
                 return EP_UNARY;
             }
 
-            double Evaluate(InterpretFunc args) const override {
+            void Compile(std::vector<Instruction>& program) const override {
+                operand_->Compile(program);
+                // unary plus does not change the value and needs no code
                 if (type_ == UnaryMinus) {
-                    return -operand_->Evaluate(args);
-                } else {
-                    return operand_->Evaluate(args);
+                    Instruction instruction{};
+                    instruction.code = Instruction::OpCode::Negate;
+                    program.push_back(instruction);
                 }
             }
 
+            size_t GetAllocatedBytes() const override {
+                return sizeof(*this) + operand_->GetAllocatedBytes();
+            }
+
         private:
             Type type_;
             std::unique_ptr<Expr> operand_;
@@ -226,24 +251,33 @@ namespace ASTImpl {
                 : cell_(cell) {
             }
 
-            void Print(std::ostream& out) const override {
-                if (!cell_->IsValid()) {
+            void Print(std::ostream& out, Position offset) const override {
+                Position cell{cell_->row + offset.row, cell_->col + offset.col};
+                if (!cell.IsValid()) {
                     out << FormulaError::Category::Ref;
                 } else {
-                    out << cell_->ToString();
+                    out << cell.ToString();
                 }
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                Print(out);
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                                Position offset) const override {
+                Print(out, offset);
             }
 
             ExprPrecedence GetPrecedence() const override {
                 return EP_ATOM;
             }
 
-            double Evaluate(InterpretFunc args) const override {
-                return args(*cell_);
+            void Compile(std::vector<Instruction>& program) const override {
+                Instruction instruction{};
+                instruction.code = Instruction::OpCode::LoadCell;
+                instruction.cell = {cell_->row, cell_->col};
+                program.push_back(instruction);
+            }
+
+            size_t GetAllocatedBytes() const override {
+                return sizeof(*this);
             }
 
         private:
@@ -257,11 +291,12 @@ namespace ASTImpl {
                 : value_(value) {
             }
 
-            void Print(std::ostream& out) const override {
+            void Print(std::ostream& out, Position /* offset */) const override {
                 out << value_;
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                                Position /* offset */) const override {
                 out << value_;
             }
 
@@ -269,8 +304,15 @@ namespace ASTImpl {
                 return EP_ATOM;
             }
 
-            double Evaluate(InterpretFunc /*args*/) const override {
-                return value_;
+            void Compile(std::vector<Instruction>& program) const override {
+                Instruction instruction{};
+                instruction.code = Instruction::OpCode::PushNumber;
+                instruction.number = value_;
+                program.push_back(instruction);
+            }
+
+            size_t GetAllocatedBytes() const override {
+                return sizeof(*this);
             }
 
         private:
@@ -278,6 +320,138 @@ namespace ASTImpl {
         };
 
 
+        // A range is only an argument of a function, it has no value of its own
+        class RangeExpr final : public Expr {
+        public:
+            explicit RangeExpr(const CellRange* range)
+                : range_(range) {
+            }
+
+            void Print(std::ostream& out, Position offset) const override {
+                CellRange range{{range_->first.row + offset.row, range_->first.col + offset.col},
+                                {range_->last.row + offset.row, range_->last.col + offset.col}};
+                if (!range.IsValid()) {
+                    out << FormulaError::Category::Ref;
+                } else {
+                    out << range.ToString();
+                }
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                                Position offset) const override {
+                Print(out, offset);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            void Compile(std::vector<Instruction>& program) const override {
+                Instruction instruction{};
+                instruction.code = Instruction::OpCode::LoadRange;
+                instruction.range = range_;
+                program.push_back(instruction);
+            }
+
+            bool IsRange() const override {
+                return true;
+            }
+
+            size_t GetAllocatedBytes() const override {
+                return sizeof(*this);
+            }
+
+        private:
+            const CellRange* range_;
+        };
+
+
+        constexpr std::string_view FUNCTION_NAMES[] = {"SUM", "AVERAGE", "MIN", "MAX", "COUNT"};
+
+        std::optional<Function> FindFunction(std::string_view name) {
+            for (size_t i = 0; i < std::size(FUNCTION_NAMES); ++i) {
+                if (FUNCTION_NAMES[i] == name) {
+                    return static_cast<Function>(i);
+                }
+            }
+            return std::nullopt;
+        }
+
+
+        class FunctionExpr final : public Expr {
+        public:
+            explicit FunctionExpr(Function function, std::vector<std::unique_ptr<Expr>> args)
+                : function_(function)
+                , args_(std::move(args)) {
+            }
+
+            void Print(std::ostream& out, Position offset) const override {
+                out << '(' << FUNCTION_NAMES[static_cast<size_t>(function_)];
+                for (const auto& arg : args_) {
+                    out << ' ';
+                    arg->Print(out, offset);
+                }
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                                Position offset) const override {
+                out << FUNCTION_NAMES[static_cast<size_t>(function_)] << '(';
+                bool first = true;
+                for (const auto& arg : args_) {
+                    if (!first) {
+                        out << ',';
+                    }
+                    first = false;
+                    // the arguments are separated by commas and never need parentheses
+                    arg->PrintFormula(out, EP_ATOM, offset);
+                }
+                out << ')';
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            void Compile(std::vector<Instruction>& program) const override {
+                Instruction instruction{};
+                instruction.code = Instruction::OpCode::CallFunction;
+                instruction.call = {function_, 0, 0};
+                for (const auto& arg : args_) {
+                    arg->Compile(program);
+                    ++(arg->IsRange() ? instruction.call.ranges : instruction.call.numbers);
+                }
+                program.push_back(instruction);
+            }
+
+            size_t GetAllocatedBytes() const override {
+                size_t bytes = sizeof(*this) + args_.capacity() * sizeof(args_[0]);
+                for (const auto& arg : args_) {
+                    bytes += arg->GetAllocatedBytes();
+                }
+                return bytes;
+            }
+
+        private:
+            Function function_;
+            std::vector<std::unique_ptr<Expr>> args_;
+        };
+
+
+        // The corners may be given in any order, the range is stored
+        // by its top left and bottom right corners
+        CellRange MakeRange(std::string_view first_str, std::string_view last_str) {
+            auto first = Position::FromString(first_str);
+            auto last = Position::FromString(last_str);
+            if (!first.IsValid() || !last.IsValid()) {
+                throw FormulaException("Invalid range: " + std::string(first_str) + ':'
+                                       + std::string(last_str));
+            }
+            return {{std::min(first.row, last.row), std::min(first.col, last.col)},
+                    {std::max(first.row, last.row), std::max(first.col, last.col)}};
+        }
+
+
         class ParseASTListener final : public FormulaBaseListener {
         public:
             std::unique_ptr<Expr> MoveRoot() {
@@ -292,6 +466,10 @@ namespace ASTImpl {
                 return std::move(cells_);
             }
 
+            std::forward_list<CellRange> MoveRanges() {
+                return std::move(ranges_);
+            }
+
         public:
             void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
                 assert(args_.size() >= 1);
@@ -359,6 +537,28 @@ namespace ASTImpl {
                 args_.back() = std::move(node);
             }
 
+            void exitRange(FormulaParser::RangeContext* ctx) override {
+                auto first_str = ctx->CELL(0)->getSymbol()->getText();
+                auto last_str = ctx->CELL(1)->getSymbol()->getText();
+                ranges_.push_front(MakeRange(first_str, last_str));
+                auto node = std::make_unique<RangeExpr>(&ranges_.front());
+                args_.push_back(std::move(node));
+            }
+
+            void exitFunction(FormulaParser::FunctionContext* ctx) override {
+                const size_t arg_count = ctx->arg().size();
+                assert(args_.size() >= arg_count);
+
+                std::vector<std::unique_ptr<Expr>> args(std::make_move_iterator(args_.end() - arg_count),
+                                                        std::make_move_iterator(args_.end()));
+                args_.resize(args_.size() - arg_count);
+
+                auto function = FindFunction(ctx->FUNCTION()->getSymbol()->getText());
+                assert(function.has_value());
+                auto node = std::make_unique<FunctionExpr>(*function, std::move(args));
+                args_.push_back(std::move(node));
+            }
+
             void visitErrorNode(antlr4::tree::ErrorNode* node) override {
                 throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
             }
@@ -366,6 +566,7 @@ namespace ASTImpl {
         private:
             std::vector<std::unique_ptr<Expr>> args_;
             std::forward_list<Position> cells_;
+            std::forward_list<CellRange> ranges_;
         };
 
 
@@ -377,6 +578,367 @@ namespace ASTImpl {
                 throw ParsingError("Error when lexing: " + msg);
             }
         };
+
+
+        // Lexer of the Formula.g4 grammar. Tokens are views of the text,
+        // the longest match wins as in the ANTLR lexer.
+        class Lexer {
+        public:
+            enum class TokenType {
+                Number,
+                Cell,
+                Add,
+                Sub,
+                Mul,
+                Div,
+                LeftParen,
+                RightParen,
+                Colon,
+                Comma,
+                Function,
+                End,
+            };
+
+            struct Token {
+                TokenType type = TokenType::End;
+                std::string_view text;
+            };
+
+            explicit Lexer(std::string_view text)
+                : text_(text) {
+                Next();
+            }
+
+            const Token& Peek() const {
+                return token_;
+            }
+
+            // Moves to the next token, throws ParsingError on a character
+            // that does not start any token
+            void Next() {
+                while (pos_ < text_.size()
+                       && (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n'
+                           || text_[pos_] == '\r')) {
+                    ++pos_;
+                }
+                if (pos_ == text_.size()) {
+                    token_ = {TokenType::End, {}};
+                    return;
+                }
+
+                size_t start = pos_;
+                TokenType type;
+                switch (text_[pos_]) {
+                    case '+':
+                        type = TokenType::Add;
+                        break;
+                    case '-':
+                        type = TokenType::Sub;
+                        break;
+                    case '*':
+                        type = TokenType::Mul;
+                        break;
+                    case '/':
+                        type = TokenType::Div;
+                        break;
+                    case '(':
+                        type = TokenType::LeftParen;
+                        break;
+                    case ')':
+                        type = TokenType::RightParen;
+                        break;
+                    case ':':
+                        type = TokenType::Colon;
+                        break;
+                    case ',':
+                        type = TokenType::Comma;
+                        break;
+                    default: {
+                        size_t end = MatchNumber(pos_);
+                        type = TokenType::Number;
+                        if (end == pos_) {
+                            end = MatchCell(pos_);
+                            type = TokenType::Cell;
+                        }
+                        if (end == pos_) {
+                            end = MatchFunction(pos_);
+                            type = TokenType::Function;
+                        }
+                        if (end == pos_) {
+                            throw ParsingError("Error when lexing: "
+                                               + std::string(text_.substr(pos_, 1)));
+                        }
+                        pos_ = end;
+                        token_ = {type, text_.substr(start, end - start)};
+                        return;
+                    }
+                }
+                ++pos_;
+                token_ = {type, text_.substr(start, 1)};
+            }
+
+        private:
+            static bool IsDigit(char c) {
+                return c >= '0' && c <= '9';
+            }
+
+            static bool IsUpper(char c) {
+                return c >= 'A' && c <= 'Z';
+            }
+
+            size_t SkipDigits(size_t pos) const {
+                while (pos < text_.size() && IsDigit(text_[pos])) {
+                    ++pos;
+                }
+                return pos;
+            }
+
+            // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+            // returns the end of the longest number starting at pos or pos itself
+            size_t MatchNumber(size_t pos) const {
+                size_t end = SkipDigits(pos);
+                if (end < text_.size() && text_[end] == '.') {
+                    size_t fraction_end = SkipDigits(end + 1);
+                    if (fraction_end == end + 1) {
+                        return end;  // '.' has to be followed by digits
+                    }
+                    end = fraction_end;
+                }
+                if (end == pos) {
+                    return pos;
+                }
+                if (end < text_.size() && (text_[end] == 'e' || text_[end] == 'E')) {
+                    size_t exponent = end + 1;
+                    if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                        ++exponent;
+                    }
+                    size_t exponent_end = SkipDigits(exponent);
+                    if (exponent_end > exponent) {
+                        end = exponent_end;
+                    }
+                }
+                return end;
+            }
+
+            // CELL: [A-Z]+[0-9]+
+            size_t MatchCell(size_t pos) const {
+                size_t end = pos;
+                while (end < text_.size() && IsUpper(text_[end])) {
+                    ++end;
+                }
+                if (end == pos) {
+                    return pos;
+                }
+                size_t digits_end = SkipDigits(end);
+                return digits_end > end ? digits_end : pos;
+            }
+
+            // FUNCTION: 'SUM' | 'AVERAGE' | 'MIN' | 'MAX' | 'COUNT', tried after CELL,
+            // which is longer whenever both match
+            size_t MatchFunction(size_t pos) const {
+                for (std::string_view name : FUNCTION_NAMES) {
+                    if (text_.substr(pos, name.size()) == name) {
+                        return pos + name.size();
+                    }
+                }
+                return pos;
+            }
+
+            std::string_view text_;
+            size_t pos_ = 0;
+            Token token_;
+        };
+
+
+        // Hand-written parser of the Formula.g4 grammar. It reads the text
+        // through string_view tokens and builds the same AST as the ANTLR
+        // pipeline: unary operators bind tighter than binary ones, '*' and '/'
+        // tighter than '+' and '-', binary operators are left-associative.
+        // A range is allowed only as a function argument.
+        class ExpressionParser {
+        public:
+            explicit ExpressionParser(std::string_view text)
+                : lexer_(text) {
+            }
+
+            std::unique_ptr<Expr> ParseMain() {
+                auto root = ParseBinary(PREC_ADDITIVE);
+                if (lexer_.Peek().type != TokenType::End) {
+                    throw ParsingError("Unexpected token: " + std::string(lexer_.Peek().text));
+                }
+                return root;
+            }
+
+            std::forward_list<Position> MoveCells() {
+                return std::move(cells_);
+            }
+
+            std::forward_list<CellRange> MoveRanges() {
+                return std::move(ranges_);
+            }
+
+        private:
+            using TokenType = Lexer::TokenType;
+
+            enum Precedence {
+                PREC_NONE,
+                PREC_ADDITIVE,
+                PREC_MULTIPLICATIVE,
+            };
+
+            static Precedence GetBinaryPrecedence(TokenType type) {
+                switch (type) {
+                    case TokenType::Add:
+                    case TokenType::Sub:
+                        return PREC_ADDITIVE;
+                    case TokenType::Mul:
+                    case TokenType::Div:
+                        return PREC_MULTIPLICATIVE;
+                    default:
+                        return PREC_NONE;
+                }
+            }
+
+            static BinaryOpExpr::Type GetBinaryType(TokenType type) {
+                switch (type) {
+                    case TokenType::Add:
+                        return BinaryOpExpr::Add;
+                    case TokenType::Sub:
+                        return BinaryOpExpr::Subtract;
+                    case TokenType::Mul:
+                        return BinaryOpExpr::Multiply;
+                    default:
+                        assert(type == TokenType::Div);
+                        return BinaryOpExpr::Divide;
+                }
+            }
+
+            std::unique_ptr<Expr> ParseBinary(Precedence min_precedence) {
+                return ParseBinary(ParseUnary(), min_precedence);
+            }
+
+            // Continues the expression starting with the already parsed lhs
+            std::unique_ptr<Expr> ParseBinary(std::unique_ptr<Expr> lhs, Precedence min_precedence) {
+                for (;;) {
+                    Precedence precedence = GetBinaryPrecedence(lexer_.Peek().type);
+                    if (precedence == PREC_NONE || precedence < min_precedence) {
+                        return lhs;
+                    }
+                    auto type = GetBinaryType(lexer_.Peek().type);
+                    lexer_.Next();
+                    auto rhs = ParseBinary(static_cast<Precedence>(precedence + 1));
+                    lhs = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+                }
+            }
+
+            std::unique_ptr<Expr> ParseUnary() {
+                switch (lexer_.Peek().type) {
+                    case TokenType::Add:
+                    case TokenType::Sub: {
+                        auto type = lexer_.Peek().type == TokenType::Sub ? UnaryOpExpr::UnaryMinus
+                                                                  : UnaryOpExpr::UnaryPlus;
+                        lexer_.Next();
+                        return std::make_unique<UnaryOpExpr>(type, ParseUnary());
+                    }
+                    case TokenType::LeftParen: {
+                        lexer_.Next();
+                        auto expr = ParseBinary(PREC_ADDITIVE);
+                        if (lexer_.Peek().type != TokenType::RightParen) {
+                            throw ParsingError("Expected ')'");
+                        }
+                        lexer_.Next();
+                        return expr;
+                    }
+                    case TokenType::Number: {
+                        auto node = std::make_unique<NumberExpr>(ParseNumber(lexer_.Peek().text));
+                        lexer_.Next();
+                        return node;
+                    }
+                    case TokenType::Cell: {
+                        auto node = ParseCell(lexer_.Peek().text);
+                        lexer_.Next();
+                        return node;
+                    }
+                    case TokenType::Function:
+                        return ParseFunction();
+                    default:
+                        throw ParsingError("Unexpected token: " + std::string(lexer_.Peek().text));
+                }
+            }
+
+            std::unique_ptr<Expr> ParseCell(std::string_view text) {
+                auto value = Position::FromString(text);
+                if (!value.IsValid()) {
+                    throw FormulaException("Invalid position: " + std::string(text));
+                }
+                cells_.push_front(value);
+                return std::make_unique<CellExpr>(&cells_.front());
+            }
+
+            // FUNCTION '(' arg (',' arg)* ')'
+            std::unique_ptr<Expr> ParseFunction() {
+                auto function = FindFunction(lexer_.Peek().text);
+                assert(function.has_value());
+                lexer_.Next();
+                Expect(TokenType::LeftParen, "Expected '('");
+                std::vector<std::unique_ptr<Expr>> args;
+                args.push_back(ParseArgument());
+                while (lexer_.Peek().type == TokenType::Comma) {
+                    lexer_.Next();
+                    args.push_back(ParseArgument());
+                }
+                Expect(TokenType::RightParen, "Expected ')'");
+                return std::make_unique<FunctionExpr>(*function, std::move(args));
+            }
+
+            // arg: CELL ':' CELL | expr; a cell not followed by ':' starts an expression
+            std::unique_ptr<Expr> ParseArgument() {
+                if (lexer_.Peek().type != TokenType::Cell) {
+                    return ParseBinary(PREC_ADDITIVE);
+                }
+                std::string_view first = lexer_.Peek().text;
+                lexer_.Next();
+                if (lexer_.Peek().type != TokenType::Colon) {
+                    return ParseBinary(ParseCell(first), PREC_ADDITIVE);
+                }
+                lexer_.Next();
+                if (lexer_.Peek().type != TokenType::Cell) {
+                    throw ParsingError("Expected a cell after ':'");
+                }
+                ranges_.push_front(MakeRange(first, lexer_.Peek().text));
+                lexer_.Next();
+                return std::make_unique<RangeExpr>(&ranges_.front());
+            }
+
+            void Expect(TokenType type, const char* message) {
+                if (lexer_.Peek().type != type) {
+                    throw ParsingError(message);
+                }
+                lexer_.Next();
+            }
+
+            // Converts the literal the same way as the stream extraction
+            // of the ANTLR listener does it
+            static double ParseNumber(std::string_view text) {
+                double value = 0;
+                auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+                if (ec == std::errc() && end == text.data() + text.size()) {
+                    return value;
+                }
+                // out of range literals are rare, let the stream decide
+                // between an underflow to zero and an overflow error
+                std::istringstream in{std::string(text)};
+                in >> value;
+                if (!in) {
+                    throw ParsingError("Invalid number: " + std::string(text));
+                }
+                return value;
+            }
+
+            Lexer lexer_;
+            std::forward_list<Position> cells_;
+            std::forward_list<CellRange> ranges_;
+        };
     }  // namespace
 }  // namespace ASTImpl
 
@@ -402,13 +964,44 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveRanges());
+}
+
+std::optional<std::string> RelativeFormulaKey(std::string_view expression, Position anchor) {
+    using ASTImpl::Lexer;
+
+    std::string key;
+    key.reserve(expression.size() + 16);
+    try {
+        for (Lexer lexer(expression); lexer.Peek().type != Lexer::TokenType::End; lexer.Next()) {
+            const auto& token = lexer.Peek();
+            if (!key.empty()) {
+                key += ' ';  // keeps "1 2" and "12" apart
+            }
+            if (token.type != Lexer::TokenType::Cell) {
+                key += token.text;
+                continue;
+            }
+            Position cell = Position::FromString(token.text);
+            if (!cell.IsValid()) {
+                return std::nullopt;
+            }
+            key += 'R';
+            key += std::to_string(cell.row - anchor.row);
+            key += 'C';
+            key += std::to_string(cell.col - anchor.col);
+        }
+    } catch (const ParsingError&) {
+        return std::nullopt;
+    }
+    return key;
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
     try {
-        return ParseFormulaAST(in);
+        ASTImpl::ExpressionParser parser(in_str);
+        auto root = parser.ParseMain();
+        return FormulaAST(std::move(root), parser.MoveCells(), parser.MoveRanges());
     } catch (...) {
         throw FormulaException("Syntactically invalid formula");
     }
@@ -419,22 +1012,376 @@ void FormulaAST::PrintCells(std::ostream& out) const {
         out << cell.ToString() << ' ';
 }
 
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+void FormulaAST::Print(std::ostream& out, Position offset) const {
+    root_expr_->Print(out, offset);
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, Position offset) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, offset);
+}
+
+void FormulaAST::Shift(Position offset) {
+    for (Position& cell : cells_) {
+        cell.row += offset.row;
+        cell.col += offset.col;
+    }
+    for (CellRange& range : ranges_) {
+        range.first.row += offset.row;
+        range.first.col += offset.col;
+        range.last.row += offset.row;
+        range.last.col += offset.col;
+    }
+    Compile();
+}
+
+namespace {
+    // The kernels run over contiguous numbers with several independent
+    // accumulators, so the compiler turns the loops into vector instructions
+    constexpr size_t KERNEL_LANES = 8;
+
+    double SumKernel(const double* numbers, size_t count) {
+        std::array<double, KERNEL_LANES> sums{};
+        size_t i = 0;
+        for (; i + KERNEL_LANES <= count; i += KERNEL_LANES) {
+            for (size_t lane = 0; lane < KERNEL_LANES; ++lane) {
+                sums[lane] += numbers[i + lane];
+            }
+        }
+        double sum = 0.0;
+        for (double lane_sum : sums) {
+            sum += lane_sum;
+        }
+        for (; i < count; ++i) {
+            sum += numbers[i];
+        }
+        return sum;
+    }
+
+    template <typename Select>
+    double SelectKernel(const double* numbers, size_t count, Select select) {
+        if (count == 0) {
+            return 0.0;
+        }
+        std::array<double, KERNEL_LANES> selected;
+        selected.fill(numbers[0]);
+        size_t i = 0;
+        for (; i + KERNEL_LANES <= count; i += KERNEL_LANES) {
+            for (size_t lane = 0; lane < KERNEL_LANES; ++lane) {
+                selected[lane] = select(selected[lane], numbers[i + lane]);
+            }
+        }
+        double result = selected[0];
+        for (double lane_selected : selected) {
+            result = select(result, lane_selected);
+        }
+        for (; i < count; ++i) {
+            result = select(result, numbers[i]);
+        }
+        return result;
+    }
+
+    // MIN and MAX of no numbers are zero, AVERAGE of them is a division by zero
+    ExecuteResult Aggregate(ASTImpl::Function function, const std::vector<double>& numbers) {
+        using ASTImpl::Function;
+        switch (function) {
+            case Function::Sum:
+                return SumKernel(numbers.data(), numbers.size());
+            case Function::Average:
+                if (numbers.empty()) {
+                    return FormulaError(FormulaError::Category::Div0);
+                }
+                return SumKernel(numbers.data(), numbers.size()) / numbers.size();
+            case Function::Min:
+                return SelectKernel(numbers.data(), numbers.size(), [](double lhs, double rhs) {
+                    return rhs < lhs ? rhs : lhs;
+                });
+            case Function::Max:
+                return SelectKernel(numbers.data(), numbers.size(), [](double lhs, double rhs) {
+                    return rhs > lhs ? rhs : lhs;
+                });
+            case Function::Count:
+                return static_cast<double>(numbers.size());
+        }
+        assert(false);
+        return 0.0;
+    }
+
+    // Collects the numbers of a call: the scalar arguments and the numbers
+    // of the ranges moved by offset
+    std::optional<FormulaError> CollectArguments(const InterpretRangeFunc& range_args,
+                                                 const CellRange* const* ranges, size_t range_count,
+                                                 Position offset, std::vector<double>& numbers) {
+        for (size_t i = 0; i < range_count; ++i) {
+            CellRange range{{ranges[i]->first.row + offset.row, ranges[i]->first.col + offset.col},
+                            {ranges[i]->last.row + offset.row, ranges[i]->last.col + offset.col}};
+            if (!range.IsValid()) {
+                return FormulaError(FormulaError::Category::Ref);
+            }
+            if (auto error = range_args(range, numbers)) {
+                return error;
+            }
+        }
+        return std::nullopt;
+    }
+}  // namespace
+
+ExecuteResult FormulaAST::Execute(const InterpretFunc& args, const InterpretRangeFunc& range_args,
+                                  Position offset) const {
+    using ASTImpl::Instruction;
+    PROFILE_INSTRUCTIONS(program_.size());
+
+    // short formulas are evaluated on the C++ stack without allocations
+    constexpr size_t INLINE_STACK_SIZE = 64;
+    std::array<double, INLINE_STACK_SIZE> inline_stack;
+    std::vector<double> heap_stack;
+    double* top = inline_stack.data();
+    if (max_stack_depth_ > INLINE_STACK_SIZE) {
+        heap_stack.resize(max_stack_depth_);
+        top = heap_stack.data();
+    }
+
+    // only the formulas with functions use these
+    std::vector<const CellRange*> ranges;
+    std::vector<double> numbers;
+
+    // top points past the last stack element;
+    // the first error stops the evaluation and becomes the result
+    for (const Instruction& instruction : program_) {
+        switch (instruction.code) {
+            case Instruction::OpCode::PushNumber:
+                *top++ = instruction.number;
+                break;
+            case Instruction::OpCode::LoadRange:
+                ranges.push_back(instruction.range);
+                break;
+            case Instruction::OpCode::CallFunction: {
+                const auto& call = instruction.call;
+                top -= call.numbers;
+                numbers.assign(top, top + call.numbers);
+                auto error = CollectArguments(range_args, ranges.data() + ranges.size() - call.ranges,
+                                              call.ranges, offset, numbers);
+                ranges.resize(ranges.size() - call.ranges);
+                if (error) {
+                    return *error;
+                }
+                auto result = Aggregate(call.function, numbers);
+                if (const double* number = std::get_if<double>(&result)) {
+                    *top++ = *number;
+                } else {
+                    return result;
+                }
+                break;
+            }
+            case Instruction::OpCode::LoadCell: {
+                auto value = args(Position{instruction.cell.row + offset.row,
+                                           instruction.cell.col + offset.col});
+                if (const double* number = std::get_if<double>(&value)) {
+                    *top++ = *number;
+                } else {
+                    return std::get<FormulaError>(value);
+                }
+                break;
+            }
+            case Instruction::OpCode::Negate:
+                top[-1] = -top[-1];
+                break;
+            case Instruction::OpCode::Add:
+                --top;
+                top[-1] = top[-1] + top[0];
+                break;
+            case Instruction::OpCode::Subtract:
+                --top;
+                top[-1] = top[-1] - top[0];
+                break;
+            case Instruction::OpCode::Multiply:
+                --top;
+                top[-1] = top[-1] * top[0];
+                break;
+            case Instruction::OpCode::Divide:
+                --top;
+                top[-1] = top[-1] / top[0];
+                break;
+        }
+        // the result of an arithmetic operation has to be a finite number
+        if (instruction.code >= Instruction::OpCode::Add && !std::isfinite(top[-1])) {
+            return FormulaError(FormulaError::Category::Div0);
+        }
+    }
+    return top[-1];
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::ExecuteBatch(const InterpretFunc& args, const InterpretRangeFunc& range_args,
+                              const std::vector<Position>& offsets, std::vector<ExecuteResult>& results) const {
+    using ASTImpl::Instruction;
+
+    const size_t lanes = offsets.size();
+    // stack level N of all the lanes is stack[N * lanes, (N + 1) * lanes)
+    std::vector<double> stack(max_stack_depth_ * lanes);
+    // the first error of every lane, it stays its result
+    std::vector<std::optional<FormulaError>> errors(lanes);
+    size_t depth = 0;
+
+    auto level = [&stack, lanes](size_t index) {
+        return stack.data() + index * lanes;
+    };
+
+    std::vector<const CellRange*> ranges;
+    std::vector<double> numbers;
+
+    for (const Instruction& instruction : program_) {
+        switch (instruction.code) {
+            case Instruction::OpCode::PushNumber:
+                std::fill_n(level(depth++), lanes, instruction.number);
+                break;
+            case Instruction::OpCode::LoadRange:
+                ranges.push_back(instruction.range);
+                break;
+            case Instruction::OpCode::CallFunction: {
+                // the ranges of every lane are other cells, so the lanes are
+                // aggregated one by one
+                const auto& call = instruction.call;
+                depth -= call.numbers;
+                const CellRange* const* call_ranges = ranges.data() + ranges.size() - call.ranges;
+                double* result = level(depth++);
+                for (size_t lane = 0; lane < lanes; ++lane) {
+                    if (errors[lane]) {
+                        result[lane] = 0.0;
+                        continue;
+                    }
+                    numbers.clear();
+                    for (size_t arg = 0; arg < call.numbers; ++arg) {
+                        numbers.push_back(level(depth - 1 + arg)[lane]);
+                    }
+                    auto value = CollectArguments(range_args, call_ranges, call.ranges, offsets[lane], numbers);
+                    auto aggregate = value ? ExecuteResult(*value) : Aggregate(call.function, numbers);
+                    if (const double* number = std::get_if<double>(&aggregate); number && std::isfinite(*number)) {
+                        result[lane] = *number;
+                    } else if (number) {
+                        result[lane] = 0.0;
+                        errors[lane] = FormulaError(FormulaError::Category::Div0);
+                    } else {
+                        result[lane] = 0.0;
+                        errors[lane] = std::get<FormulaError>(aggregate);
+                    }
+                }
+                ranges.resize(ranges.size() - call.ranges);
+                break;
+            }
+            case Instruction::OpCode::LoadCell: {
+                double* top = level(depth++);
+                for (size_t lane = 0; lane < lanes; ++lane) {
+                    top[lane] = 0.0;
+                    if (errors[lane]) {
+                        continue;
+                    }
+                    auto value = args(Position{instruction.cell.row + offsets[lane].row,
+                                               instruction.cell.col + offsets[lane].col});
+                    if (const double* number = std::get_if<double>(&value)) {
+                        top[lane] = *number;
+                    } else {
+                        errors[lane] = std::get<FormulaError>(value);
+                    }
+                }
+                break;
+            }
+            case Instruction::OpCode::Negate: {
+                double* top = level(depth - 1);
+                for (size_t lane = 0; lane < lanes; ++lane) {
+                    top[lane] = -top[lane];
+                }
+                break;
+            }
+            default: {
+                --depth;
+                double* lhs = level(depth - 1);
+                const double* rhs = level(depth);
+                switch (instruction.code) {
+                    case Instruction::OpCode::Add:
+                        for (size_t lane = 0; lane < lanes; ++lane) {
+                            lhs[lane] += rhs[lane];
+                        }
+                        break;
+                    case Instruction::OpCode::Subtract:
+                        for (size_t lane = 0; lane < lanes; ++lane) {
+                            lhs[lane] -= rhs[lane];
+                        }
+                        break;
+                    case Instruction::OpCode::Multiply:
+                        for (size_t lane = 0; lane < lanes; ++lane) {
+                            lhs[lane] *= rhs[lane];
+                        }
+                        break;
+                    default:
+                        for (size_t lane = 0; lane < lanes; ++lane) {
+                            lhs[lane] /= rhs[lane];
+                        }
+                }
+                for (size_t lane = 0; lane < lanes; ++lane) {
+                    if (!errors[lane] && !std::isfinite(lhs[lane])) {
+                        errors[lane] = FormulaError(FormulaError::Category::Div0);
+                    }
+                }
+            }
+        }
+    }
+
+    results.clear();
+    results.reserve(lanes);
+    for (size_t lane = 0; lane < lanes; ++lane) {
+        if (errors[lane]) {
+            results.emplace_back(*errors[lane]);
+        } else {
+            results.emplace_back(level(0)[lane]);
+        }
+    }
 }
 
-double FormulaAST::Execute(InterpretFunc args) const {
-    return root_expr_->Evaluate(args);
+void FormulaAST::Compile() {
+    using ASTImpl::Instruction;
+
+    program_.clear();
+    root_expr_->Compile(program_);
+    program_.shrink_to_fit();
+
+    size_t depth = 0;
+    max_stack_depth_ = 0;
+    for (const Instruction& instruction : program_) {
+        switch (instruction.code) {
+            case Instruction::OpCode::PushNumber:
+            case Instruction::OpCode::LoadCell:
+                max_stack_depth_ = std::max(max_stack_depth_, ++depth);
+                break;
+            case Instruction::OpCode::CallFunction:
+                depth -= instruction.call.numbers;
+                max_stack_depth_ = std::max(max_stack_depth_, ++depth);
+                break;
+            case Instruction::OpCode::LoadRange:
+            case Instruction::OpCode::Negate:
+                break;
+            default:
+                --depth;
+        }
+    }
+    assert(depth == 1);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                       std::forward_list<CellRange> ranges)
     : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+    , cells_(std::move(cells))
+    , ranges_(std::move(ranges)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    ranges_.sort();
+    Compile();
+}
+
+size_t FormulaAST::GetAllocatedBytes() const {
+//A node of a forward_list holds the value and the link to the next node
+    const size_t cell_bytes = sizeof(Position) + sizeof(void*);
+    const size_t range_bytes = sizeof(CellRange) + sizeof(void*);
+    return root_expr_->GetAllocatedBytes() + program_.capacity() * sizeof(ASTImpl::Instruction)
+           + std::distance(cells_.begin(), cells_.end()) * cell_bytes
+           + std::distance(ranges_.begin(), ranges_.end()) * range_bytes;
 }
 
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
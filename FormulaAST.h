@@ -3,33 +3,111 @@
 #include "FormulaLexer.h"
 #include "common.h"
 
+#include <cstdint>
 #include <forward_list>
 #include <functional>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
+
+// Aggregate functions over numbers and ranges of cells
+enum class Function : uint8_t {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+// One step of the postfix program a formula is compiled into.
+// Operands are taken from the top of the evaluation stack and
+// the result is pushed back. Ranges are kept on a stack of their own
+// until the function they are passed to takes them.
+struct Instruction {
+    enum class OpCode : uint8_t {
+        PushNumber,  // pushes number
+        LoadCell,    // pushes the value of cell
+        LoadRange,   // pushes range to the range stack
+        Negate,
+        // the operations making new numbers go last, their results are checked
+        // to be finite
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        CallFunction,  // replaces call.numbers numbers and call.ranges ranges by the result
+    };
+
+    struct CellOperand {
+        int row;
+        int col;
+    };
+
+    struct CallOperand {
+        Function function;
+        uint16_t numbers;
+        uint16_t ranges;
+    };
+
+    OpCode code;
+    union {
+        double number;
+        CellOperand cell;
+        // points to the range stored in the AST
+        const CellRange* range;
+        CallOperand call;
+    };
+};
 }
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
+//Result of the formula evaluation: a number or an error,
+//errors are passed as values and never thrown
+using ExecuteResult = std::variant<double, FormulaError>;
+
 //Nickname for function type for correct interpretation
 //cells values or for empty cells.
-using InterpretFunc = std::function<double(Position)>;
+using InterpretFunc = std::function<ExecuteResult(Position)>;
+
+//Appends the numbers of the cells of the range to numbers, the cells
+//without a number are skipped; returns an error found in the range
+using InterpretRangeFunc = std::function<std::optional<FormulaError>(CellRange, std::vector<double>& numbers)>;
 
 class FormulaAST {
 public:
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+                        std::forward_list<Position> cells,
+                        std::forward_list<CellRange> ranges = {});
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    double Execute(InterpretFunc args) const;
+    // offset is added to every cell and range reference of the formula,
+    // so one AST can serve formulas filled into different cells
+    ExecuteResult Execute(const InterpretFunc& args, const InterpretRangeFunc& range_args,
+                          Position offset = {}) const;
+    // Evaluates the formula for every offset at once. Each instruction is
+    // applied to all of them before the next one, so the arithmetic runs
+    // over contiguous arrays; results[i] is the result for offsets[i].
+    void ExecuteBatch(const InterpretFunc& args, const InterpretRangeFunc& range_args,
+                      const std::vector<Position>& offsets, std::vector<ExecuteResult>& results) const;
     void PrintCells(std::ostream& out) const;
-    void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    void Print(std::ostream& out, Position offset = {}) const;
+    void PrintFormula(std::ostream& out, Position offset = {}) const;
+
+    // Moves all cell and range references by offset
+    void Shift(Position offset);
+
+    // Bytes allocated by the AST: the tree, the program and the references;
+    // the FormulaAST object itself is not included
+    size_t GetAllocatedBytes() const;
 
     std::forward_list<Position>& GetCells() {
         return cells_;
@@ -39,14 +117,36 @@ public:
         return cells_;
     }
 
+    // The ranges passed to the functions of the formula, sorted
+    const std::forward_list<CellRange>& GetRanges() const {
+        return ranges_;
+    }
+
 private:
+    void Compile();
+
     std::unique_ptr<ASTImpl::Expr> root_expr_;
 
+    // the same expression as a flat postfix program,
+    // the tree itself is kept for printing only
+    std::vector<ASTImpl::Instruction> program_;
+    size_t max_stack_depth_ = 0;
+
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
     std::forward_list<Position> cells_;
+    std::forward_list<CellRange> ranges_;
 };
 
+// Returns the text of the expression tokens with every cell reference
+// written as its offset from the anchor cell. Formulas that differ only by
+// a shift of their references (e.g. "A1*B1" in C1 and "A2*B2" in C2) get
+// the same key. Returns std::nullopt if the expression cannot be tokenized.
+std::optional<std::string> RelativeFormulaKey(std::string_view expression, Position anchor);
+
+// Parses the formula with the ANTLR generated parser
 FormulaAST ParseFormulaAST(std::istream& in);
+// Parses the formula with the hand-written parser, which builds the same AST
+// without the ANTLR machinery. Throws FormulaException on a syntax error.
 FormulaAST ParseFormulaAST(const std::string& in_str);
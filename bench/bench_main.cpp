@@ -0,0 +1,197 @@
+#include "bench_runner.h"
+#include "sheet_workloads.h"
+
+#include "common.h"
+#include "formula.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr int ROWS = 10000;
+constexpr int EVALUATIONS = 20;
+
+// Column A holds the source values, column B the formulas referencing them.
+// Formulas are evaluated directly, so referenced values are taken from
+// the cache and the measured time is the formula evaluation itself.
+size_t EvaluateColumn(const SheetInterface& sheet,
+                      const std::vector<std::unique_ptr<FormulaInterface>>& formulas) {
+    size_t errors = 0;
+    for (int i = 0; i < EVALUATIONS; ++i) {
+        for (const auto& formula : formulas) {
+            errors += std::holds_alternative<FormulaError>(formula->Evaluate(sheet));
+        }
+    }
+    if (errors % formulas.size() != 0) {
+        std::cerr << "unexpected evaluation results" << std::endl;
+    }
+    return formulas.size() * EVALUATIONS;
+}
+
+std::unique_ptr<SheetInterface> MakeSheet(const std::string& source_text) {
+    auto sheet = CreateSheet();
+    for (int row = 0; row < ROWS; ++row) {
+        sheet->SetCell(Position{row, 0}, source_text);
+        sheet->SetCell(Position{row, 1}, "=A" + std::to_string(row + 1) + "*2");
+    }
+    return sheet;
+}
+
+std::vector<std::unique_ptr<FormulaInterface>> MakeFormulas(const std::string& pattern) {
+    std::vector<std::unique_ptr<FormulaInterface>> formulas;
+    formulas.reserve(ROWS);
+    for (int row = 0; row < ROWS; ++row) {
+        const std::string name = std::to_string(row + 1);
+        formulas.push_back(ParseFormula("A" + name + pattern + "B" + name));
+    }
+    return formulas;
+}
+
+void BenchErrorPropagation(BenchRunner& runner) {
+    const auto formulas = MakeFormulas("+1+");
+
+    auto numbers = MakeSheet("1");
+    runner.Run("evaluate/numeric sheet", [&] {
+        return EvaluateColumn(*numbers, formulas);
+    });
+
+    auto values = MakeSheet("text");
+    runner.Run("evaluate/#VALUE! sheet", [&] {
+        return EvaluateColumn(*values, formulas);
+    });
+
+    auto div0 = MakeSheet("=1/0");
+    runner.Run("evaluate/#DIV/0! sheet", [&] {
+        return EvaluateColumn(*div0, formulas);
+    });
+
+    // what every error cost when it was thrown out of the evaluator
+    runner.Run("reference/throw and catch FormulaError", [] {
+        size_t caught = 0;
+        for (int i = 0; i < ROWS * EVALUATIONS; ++i) {
+            try {
+                throw FormulaError(FormulaError::Category::Value);
+            } catch (const FormulaError&) {
+                ++caught;
+            }
+        }
+        return caught;
+    });
+}
+
+// One input cell feeds FORMULA_COLS x FORMULA_ROWS formulas; every formula
+// also reads its left neighbour, so there are FORMULA_COLS levels of
+// FORMULA_ROWS independent cells.
+constexpr int FORMULA_ROWS = 12500;
+constexpr int FORMULA_COLS = 16;
+
+std::unique_ptr<SheetInterface> MakeFanOutSheet() {
+    auto sheet = CreateSheet();
+    sheet->SetCell(Position{0, 0}, "1");
+    for (int row = 1; row <= FORMULA_ROWS; ++row) {
+        sheet->SetCell(Position{row, 0}, "=A1+" + std::to_string(row));
+        for (int col = 1; col < FORMULA_COLS; ++col) {
+            const Position left{row, col - 1};
+            sheet->SetCell(Position{row, col}, "=A1+" + left.ToString() + "*2");
+        }
+    }
+    return sheet;
+}
+
+void BenchRecalculate(BenchRunner& runner) {
+    auto sheet = MakeFanOutSheet();
+    const size_t formulas = static_cast<size_t>(FORMULA_ROWS) * FORMULA_COLS;
+    int input = 1;
+
+    // the serial part every measurement below includes
+    runner.Run("recalculate/invalidate only", [&] {
+        sheet->SetCell(Position{0, 0}, std::to_string(++input));
+        return formulas;
+    });
+
+    const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        runner.Run("recalculate/" + std::to_string(formulas) + " formulas, "
+                   + std::to_string(threads) + " threads", [&] {
+            sheet->SetCell(Position{0, 0}, std::to_string(++input));
+            sheet->Recalculate(threads);
+            return formulas;
+        });
+        if (threads < max_threads && threads * 2 > max_threads) {
+            threads = max_threads / 2;
+        }
+    }
+
+    // the same work calculated on demand row by row, in the order the cells
+    // were created (a level of Recalculate() is a column here)
+    runner.Run("recalculate/on demand by GetValue()", [&] {
+        sheet->SetCell(Position{0, 0}, std::to_string(++input));
+        for (int row = 1; row <= FORMULA_ROWS; ++row) {
+            for (int col = 0; col < FORMULA_COLS; ++col) {
+                sheet->GetCell(Position{row, col})->GetValue();
+            }
+        }
+        return formulas;
+    });
+}
+
+// The same total of a column written as a chain of additions and as SUM
+// of a range, evaluated directly against the cached source values
+void BenchAggregates(BenchRunner& runner) {
+    constexpr int RANGE_ROWS = 500;
+    auto sheet = CreateSheet();
+    for (int row = 0; row < RANGE_ROWS; ++row) {
+        sheet->SetCell(Position{row, 0}, std::to_string(row));
+    }
+    std::string additions = "A1";
+    for (int row = 2; row <= RANGE_ROWS; ++row) {
+        additions += "+A" + std::to_string(row);
+    }
+    const std::string range = "A1:A" + std::to_string(RANGE_ROWS);
+    std::vector<std::pair<std::string, std::string>> cases = {
+        {"aggregate/" + std::to_string(RANGE_ROWS) + " additions", additions},
+        {"aggregate/SUM(" + range + ")", "SUM(" + range + ")"},
+        {"aggregate/MAX(" + range + ")", "MAX(" + range + ")"},
+    };
+    for (const auto& [name, expression] : cases) {
+        std::vector<std::unique_ptr<FormulaInterface>> formulas;
+        formulas.push_back(ParseFormula(expression));
+        runner.Run(name, [&] {
+            for (int i = 0; i < 100; ++i) {
+                EvaluateColumn(*sheet, formulas);
+            }
+            return size_t{100} * EVALUATIONS * RANGE_ROWS;
+        });
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    if (!options.Parse(argc, argv)) {
+        return 1;
+    }
+    BenchRunner runner(options);
+    BenchErrorPropagation(runner);
+    BenchRecalculate(runner);
+    BenchAggregates(runner);
+    BenchSheetWorkloads(runner);
+
+    if (options.json_path == "-") {
+        runner.WriteJson(std::cout);
+        return 0;
+    }
+    std::ofstream json(options.json_path);
+    runner.WriteJson(json);
+    if (!json) {
+        std::cerr << "cannot write " << options.json_path << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Settings of a benchmark run, taken from the command line:
+//   --filter TEXT  runs only the benchmarks whose name contains TEXT
+//   --repeats N    runs every benchmark N times
+//   --scale N      multiplies the sizes of the parameterized workloads
+//   --json PATH    writes the results as JSON to PATH ("-" is stdout)
+struct BenchOptions {
+    std::string filter;
+    int repeats = 5;
+    int scale = 1;
+    std::string json_path = "spreadsheet_bench.json";
+
+    // Returns false and prints the usage for unknown arguments
+    bool Parse(int argc, char** argv) {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (i + 1 == argc) {
+                return Usage(argv[0]);
+            }
+            const std::string value = argv[++i];
+            if (arg == "--filter") {
+                filter = value;
+            } else if (arg == "--repeats") {
+                repeats = std::max(1, std::stoi(value));
+            } else if (arg == "--scale") {
+                scale = std::max(1, std::stoi(value));
+            } else if (arg == "--json") {
+                json_path = value;
+            } else {
+                return Usage(argv[0]);
+            }
+        }
+        return true;
+    }
+
+private:
+    static bool Usage(const char* program) {
+        std::cerr << "usage: " << program << " [--filter TEXT] [--repeats N] [--scale N] [--json PATH]"
+                  << std::endl;
+        return false;
+    }
+};
+
+// Parameters of a workload, e.g. {{"cells", 10000}}; they are a part
+// of the reported name and are written to the JSON results separately
+using BenchParams = std::vector<std::pair<std::string, int64_t>>;
+
+// Measurements of a workload other than its time, e.g. {{"bytes_per_cell", 48.0}}
+using BenchMetrics = std::vector<std::pair<std::string, double>>;
+
+struct BenchResult {
+    std::string name;
+    BenchParams params;
+    size_t items = 0;
+    int repeats = 0;
+    double best_ns_per_item = 0.0;
+    double mean_ns_per_item = 0.0;
+    BenchMetrics metrics;
+};
+
+// Runs a benchmark function several times and reports the best time
+// per processed item. The function returns the number of items it processed.
+class BenchRunner {
+public:
+    explicit BenchRunner(BenchOptions options = {})
+        : options_(std::move(options)) {
+    }
+
+    const BenchOptions& GetOptions() const {
+        return options_;
+    }
+
+    // The size of a parameterized workload
+    int Scaled(int size) const {
+        return size * options_.scale;
+    }
+
+    template <class BenchFunc>
+    double Run(const std::string& name, BenchFunc func) {
+        return Run(name, {}, [] { return 0; }, [&func](int&) { return func(); });
+    }
+
+    // setup() prepares the state of a repeat outside the measured time,
+    // func(state) is measured; the state is destroyed after the measurement
+    template <class Setup, class BenchFunc>
+    double Run(const std::string& name, const BenchParams& params, Setup setup, BenchFunc func) {
+        using Clock = std::chrono::steady_clock;
+
+        BenchResult result{FullName(name, params), params, 0, options_.repeats, 0.0, 0.0, {}};
+        if (result.name.find(options_.filter) == std::string::npos) {
+            return 0.0;
+        }
+        double total_ns_per_item = 0.0;
+        for (int i = 0; i < options_.repeats; ++i) {
+            auto state = setup();
+            auto start = Clock::now();
+            size_t items = func(state);
+            std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+            double ns_per_item = items ? elapsed.count() / items : elapsed.count();
+            if (i == 0 || ns_per_item < result.best_ns_per_item) {
+                result.best_ns_per_item = ns_per_item;
+            }
+            total_ns_per_item += ns_per_item;
+            result.items = items;
+        }
+        result.mean_ns_per_item = total_ns_per_item / options_.repeats;
+        std::cout << std::left << std::setw(56) << result.name << std::right << std::setw(12)
+                  << std::fixed << std::setprecision(1) << result.best_ns_per_item << " ns/item"
+                  << std::endl;
+        results_.push_back(std::move(result));
+        return results_.back().best_ns_per_item;
+    }
+
+    // Reports the metrics the caller measured on `items` items; they are
+    // filtered, printed and written to the JSON results like the times
+    void Report(const std::string& name, const BenchParams& params, size_t items, BenchMetrics metrics) {
+        BenchResult result{FullName(name, params), params, items, 0, 0.0, 0.0, std::move(metrics)};
+        if (result.name.find(options_.filter) == std::string::npos) {
+            return;
+        }
+        std::cout << std::left << std::setw(56) << result.name << std::right << std::fixed
+                  << std::setprecision(1);
+        for (const auto& [metric, value] : result.metrics) {
+            std::cout << ' ' << metric << '=' << value;
+        }
+        std::cout << std::endl;
+        results_.push_back(std::move(result));
+    }
+
+    const std::vector<BenchResult>& GetResults() const {
+        return results_;
+    }
+
+    void WriteJson(std::ostream& out) const {
+        out << "{\n  \"benchmarks\": [";
+        bool first = true;
+        for (const BenchResult& result : results_) {
+            out << (first ? "\n" : ",\n");
+            first = false;
+            out << "    {\"name\": ";
+            WriteString(out, result.name);
+            out << ", \"params\": {";
+            for (size_t i = 0; i < result.params.size(); ++i) {
+                out << (i ? ", " : "");
+                WriteString(out, result.params[i].first);
+                out << ": " << result.params[i].second;
+            }
+            out << "}, \"items\": " << result.items << std::setprecision(3) << std::fixed;
+            // the reported metrics were not timed
+            if (result.repeats > 0) {
+                out << ", \"repeats\": " << result.repeats
+                    << ", \"best_ns_per_item\": " << result.best_ns_per_item
+                    << ", \"mean_ns_per_item\": " << result.mean_ns_per_item;
+            }
+            if (!result.metrics.empty()) {
+                out << ", \"metrics\": {";
+                for (size_t i = 0; i < result.metrics.size(); ++i) {
+                    out << (i ? ", " : "");
+                    WriteString(out, result.metrics[i].first);
+                    out << ": " << result.metrics[i].second;
+                }
+                out << "}";
+            }
+            out << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+private:
+    static std::string FullName(const std::string& name, const BenchParams& params) {
+        std::string full_name = name;
+        for (const auto& [param, value] : params) {
+            full_name += ' ' + param + '=' + std::to_string(value);
+        }
+        return full_name;
+    }
+
+    static void WriteString(std::ostream& out, const std::string& text) {
+        out << '"';
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                out << '\\' << c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c)
+                    << std::dec << std::setfill(' ');
+            } else {
+                out << c;
+            }
+        }
+        out << '"';
+    }
+
+    BenchOptions options_;
+    std::vector<BenchResult> results_;
+};
@@ -0,0 +1,328 @@
+#include "sheet_workloads.h"
+
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// The cells of a workload are numbered and laid out column by column,
+// BLOCK_ROWS in a column starting at first_col
+constexpr int BLOCK_ROWS = 10000;
+
+Position At(int index, int first_col = 0) {
+    return Position{index % BLOCK_ROWS, first_col + index / BLOCK_ROWS};
+}
+
+std::string Name(int index, int first_col = 0) {
+    return At(index, first_col).ToString();
+}
+
+std::unique_ptr<SheetInterface> NoSheet() {
+    return nullptr;
+}
+
+// Reads a value so the compiler cannot drop the calculation
+void Consume(const CellInterface* cell) {
+    if (cell == nullptr || std::holds_alternative<FormulaError>(cell->GetValue())) {
+        std::cerr << "unexpected benchmark result" << std::endl;
+    }
+}
+
+// A1 = 1, A2 = A1+1, ..., every cell reads the previous one
+std::unique_ptr<SheetInterface> MakeChain(int length) {
+    auto sheet = CreateSheet();
+    sheet->SetCell(At(0), "1");
+    for (int i = 1; i < length; ++i) {
+        sheet->SetCell(At(i), "=" + Name(i - 1) + "+1");
+    }
+    return sheet;
+}
+
+// Column A holds the inputs; the diamond has `width` cells in each of its
+// `levels` columns, a cell reads two neighbouring cells of the column before
+std::unique_ptr<SheetInterface> MakeDiamond(int width, int levels) {
+    auto sheet = CreateSheet();
+    for (int row = 0; row < width; ++row) {
+        sheet->SetCell(Position{row, 0}, std::to_string(row));
+    }
+    for (int col = 1; col <= levels; ++col) {
+        for (int row = 0; row < width; ++row) {
+            const Position left{row, col - 1};
+            const Position next_left{(row + 1) % width, col - 1};
+            sheet->SetCell(Position{row, col}, "=" + left.ToString() + "+" + next_left.ToString());
+        }
+    }
+    return sheet;
+}
+
+void BenchSetCell(BenchRunner& runner, int cells) {
+    const BenchParams params = {{"cells", cells}};
+    runner.Run("setcell/text", params, NoSheet, [cells](std::unique_ptr<SheetInterface>& sheet) {
+        sheet = CreateSheet();
+        for (int i = 0; i < cells; ++i) {
+            sheet->SetCell(At(i), "text" + std::to_string(i));
+        }
+        return static_cast<size_t>(cells);
+    });
+    runner.Run("setcell/number", params, NoSheet, [cells](std::unique_ptr<SheetInterface>& sheet) {
+        sheet = CreateSheet();
+        for (int i = 0; i < cells; ++i) {
+            sheet->SetCell(At(i), std::to_string(i));
+        }
+        return static_cast<size_t>(cells);
+    });
+    // every formula is another relative formula, so none is shared
+    runner.Run("setcell/formula", params, NoSheet, [cells](std::unique_ptr<SheetInterface>& sheet) {
+        sheet = CreateSheet();
+        for (int i = 0; i < cells; ++i) {
+            sheet->SetCell(At(i, 1), "=A1+" + std::to_string(i) + "*" + Name(i % 100, 1000));
+        }
+        return static_cast<size_t>(cells);
+    });
+    // the same relative formula filled down
+    runner.Run("setcell/filled formula", params, NoSheet, [cells](std::unique_ptr<SheetInterface>& sheet) {
+        sheet = CreateSheet();
+        for (int i = 0; i < cells; ++i) {
+            sheet->SetCell(At(i, 1000), "=" + Name(i) + "*2");
+        }
+        return static_cast<size_t>(cells);
+    });
+}
+
+void BenchChain(BenchRunner& runner, int length) {
+    const BenchParams params = {{"length", length}};
+    runner.Run("chain/build", params, NoSheet, [length](std::unique_ptr<SheetInterface>& sheet) {
+        sheet = MakeChain(length);
+        return static_cast<size_t>(length);
+    });
+
+    auto sheet = MakeChain(length);
+    int input = 1;
+    runner.Run("chain/change head and recalculate", params, [] { return 0; }, [&](int&) {
+        sheet->SetCell(Position{0, 0}, std::to_string(++input));
+        sheet->Recalculate(1);
+        Consume(sheet->GetCell(At(length - 1)));
+        return static_cast<size_t>(length);
+    });
+
+    // closing the chain into a loop is rejected after the whole chain is checked
+    runner.Run("chain/cycle check", params, [] { return 0; }, [&](int&) {
+        constexpr int ATTEMPTS = 10;
+        for (int i = 0; i < ATTEMPTS; ++i) {
+            try {
+                sheet->SetCell(At(0), "=" + Name(length - 1));
+                std::cerr << "the cycle is not found" << std::endl;
+            } catch (const CircularDependencyException&) {
+            }
+        }
+        return static_cast<size_t>(ATTEMPTS) * length;
+    });
+}
+
+// One input is read by `cells` formulas
+void BenchFanOut(BenchRunner& runner, int cells) {
+    const BenchParams params = {{"cells", cells}};
+    auto sheet = CreateSheet();
+    sheet->SetCell(Position{0, 0}, "1");
+    for (int i = 0; i < cells; ++i) {
+        sheet->SetCell(At(i, 1), "=A1*" + std::to_string(i));
+    }
+    int input = 1;
+    runner.Run("fanout/change input and recalculate", params, [] { return 0; }, [&](int&) {
+        sheet->SetCell(Position{0, 0}, std::to_string(++input));
+        sheet->Recalculate(1);
+        return static_cast<size_t>(cells);
+    });
+}
+
+// One formula reads `cells` inputs one by one, another reads them as a range
+void BenchFanIn(BenchRunner& runner, int cells) {
+    const BenchParams params = {{"cells", cells}};
+    auto sheet = CreateSheet();
+    std::string additions = "=" + Name(0, 2);
+    for (int i = 0; i < cells; ++i) {
+        sheet->SetCell(At(i, 2), std::to_string(i));
+        if (i > 0) {
+            additions += "+" + Name(i, 2);
+        }
+    }
+    sheet->SetCell(Position{0, 1}, additions);
+    sheet->SetCell(Position{1, 1}, "=SUM(" + Name(0, 2) + ":" + Name(cells - 1, 2) + ")");
+    int input = 1;
+    runner.Run("fanin/change input and recalculate", params, [] { return 0; }, [&](int&) {
+        sheet->SetCell(At(0, 2), std::to_string(++input));
+        Consume(sheet->GetCell(Position{0, 1}));
+        Consume(sheet->GetCell(Position{1, 1}));
+        return static_cast<size_t>(cells) * 2;
+    });
+}
+
+void BenchDiamond(BenchRunner& runner, int cells) {
+    constexpr int LEVELS = 16;
+    const int width = std::clamp(cells / LEVELS, 1, BLOCK_ROWS);
+    const BenchParams params = {{"width", width}, {"levels", LEVELS}};
+    auto sheet = MakeDiamond(width, LEVELS);
+    int input = 0;
+    runner.Run("diamond/change input and recalculate", params, [] { return 0; }, [&](int&) {
+        sheet->SetCell(Position{0, 0}, std::to_string(++input));
+        sheet->Recalculate(1);
+        return static_cast<size_t>(width) * LEVELS;
+    });
+}
+
+// The cells are cleared and set again, half of them are read by formulas
+void BenchClearCell(BenchRunner& runner, int cells) {
+    const BenchParams params = {{"cells", cells}};
+    auto sheet = CreateSheet();
+    for (int i = 0; i < cells; ++i) {
+        sheet->SetCell(At(i), std::to_string(i));
+        if (i % 2 == 0) {
+            sheet->SetCell(At(i, 1000), "=" + Name(i) + "+1");
+        }
+    }
+    runner.Run("clearcell/clear and set again", params, [] { return 0; }, [&](int&) {
+        for (int i = 0; i < cells; ++i) {
+            sheet->ClearCell(At(i));
+        }
+        for (int i = 0; i < cells; ++i) {
+            sheet->SetCell(At(i), std::to_string(i));
+        }
+        return static_cast<size_t>(cells) * 2;
+    });
+}
+
+// Destroying a sheet of numbers and of formulas filled down
+void BenchTeardown(BenchRunner& runner, int cells) {
+    const BenchParams params = {{"cells", cells}};
+    auto teardown = [cells](std::unique_ptr<SheetInterface>& sheet) {
+        sheet.reset();
+        return static_cast<size_t>(cells);
+    };
+    runner.Run("teardown/numbers", params, [cells] {
+        auto sheet = CreateSheet();
+        for (int i = 0; i < cells; ++i) {
+            sheet->SetCell(At(i), std::to_string(i));
+        }
+        return sheet;
+    }, teardown);
+    runner.Run("teardown/filled formulas", params, [cells] {
+        auto sheet = CreateSheet();
+        for (int i = 0; i < cells; ++i) {
+            sheet->SetCell(At(i, 1000), "=" + Name(i) + "*2");
+        }
+        return sheet;
+    }, teardown);
+}
+
+// The same number of cells printed from a dense block and scattered
+// over a ten times larger printable area in both directions
+void BenchPrintValues(BenchRunner& runner, int cells) {
+    constexpr int COLS = 1000;
+    constexpr int SPREAD = 10;
+    const BenchParams params = {{"cells", cells}};
+    auto dense = CreateSheet();
+    auto sparse = CreateSheet();
+    for (int i = 0; i < cells; ++i) {
+        const std::string text = i % 2 ? "text" : "=" + std::to_string(i) + "/2";
+        dense->SetCell(Position{i / COLS, i % COLS}, text);
+        sparse->SetCell(Position{i / COLS * SPREAD, i % COLS * SPREAD}, text);
+    }
+    auto print_values = [cells](const SheetInterface& sheet) {
+        return [&sheet, cells](std::ostringstream& out) {
+            sheet.PrintValues(out);
+            return static_cast<size_t>(cells);
+        };
+    };
+    auto new_output = [] { return std::ostringstream(); };
+    runner.Run("print/dense values", params, new_output, print_values(*dense));
+    runner.Run("print/sparse values", params, new_output, print_values(*sparse));
+    runner.Run("print/dense texts", params, new_output, [&](std::ostringstream& out) {
+        dense->PrintTexts(out);
+        return static_cast<size_t>(cells);
+    });
+}
+
+void BenchParse(BenchRunner& runner, int formulas) {
+    const BenchParams params = {{"formulas", formulas}};
+    std::vector<std::string> expressions;
+    expressions.reserve(formulas);
+    for (int i = 0; i < formulas; ++i) {
+        const std::string number = std::to_string(i);
+        const std::string row = std::to_string(i % BLOCK_ROWS + 1);
+        const std::string last_row = std::to_string(i % BLOCK_ROWS + 10);
+        expressions.push_back("(A" + row + "+B" + row + ")*" + number + ".5/(C1-" + number + ")+SUM(D" + row
+                              + ":E" + last_row + ")");
+    }
+    runner.Run("parse/formula", params, [] { return 0; }, [&](int&) {
+        size_t references = 0;
+        for (const std::string& expression : expressions) {
+            references += ParseFormula(expression)->GetReferencedCells().size();
+        }
+        if (references == 0) {
+            std::cerr << "unexpected parse result" << std::endl;
+        }
+        return expressions.size();
+    });
+}
+
+// The bytes a sheet holds per cell, by what they are used for
+void BenchMemory(BenchRunner& runner, int cells) {
+    const BenchParams params = {{"cells", cells}};
+    auto report = [&](const std::string& name, auto cell_text) {
+        Sheet sheet;
+        for (int i = 0; i < cells; ++i) {
+            sheet.SetCell(At(i, 1), cell_text(i));
+        }
+        const SheetMemoryUsage usage = sheet.MemoryUsage();
+        const double count = sheet.GetStats().placeholders_created + cells;
+        runner.Report(name, params, cells,
+                      {{"bytes_per_cell", usage.Total() / count},
+                       {"storage", usage.storage / count},
+                       {"cells", usage.cells / count},
+                       {"impls", usage.impls / count},
+                       {"formulas", usage.formulas / count},
+                       {"dependencies", usage.dependencies / count},
+                       {"caches", usage.caches / count},
+                       {"strings", usage.strings / count}});
+    };
+    report("memory/text", [](int i) {
+        return "some longer text " + std::to_string(i);
+    });
+    report("memory/number", [](int i) {
+        return std::to_string(i);
+    });
+    // the formulas read cells of column A, which become empty placeholders
+    report("memory/formula", [](int i) {
+        return "=" + Name(i) + "+" + std::to_string(i) + "*" + Name(i % 100);
+    });
+    report("memory/filled formula", [](int i) {
+        return "=" + Name(i) + "*2";
+    });
+}
+
+}  // namespace
+
+void BenchSheetWorkloads(BenchRunner& runner) {
+    for (int size : {1000, 10000, 100000}) {
+        const int cells = runner.Scaled(size);
+        BenchSetCell(runner, cells);
+        BenchChain(runner, cells);
+        BenchFanOut(runner, cells);
+        // the additions of a fan-in are one deep expression, so it is kept smaller
+        BenchFanIn(runner, cells / 10);
+        BenchDiamond(runner, cells);
+        BenchClearCell(runner, cells);
+        BenchTeardown(runner, cells);
+        BenchPrintValues(runner, cells);
+        BenchParse(runner, cells);
+        BenchMemory(runner, cells);
+    }
+}
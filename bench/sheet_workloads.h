@@ -0,0 +1,7 @@
+#pragma once
+
+#include "bench_runner.h"
+
+// Micro- and macro-benchmarks of the sheet operations on synthetic sheets.
+// Every workload is run for a few sizes multiplied by the --scale option.
+void BenchSheetWorkloads(BenchRunner& runner);
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "common.h"
+
+#include <charconv>
+#include <cstddef>
+#include <locale>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+//Collects the printed text in a large buffer and passes it
+//to the stream in big chunks instead of a write per cell
+class BufferedOutput {
+public:
+    explicit BufferedOutput(std::ostream& output)
+        : output_(output)
+        , default_number_format_(IsDefaultNumberFormat(output)) {
+        buffer_.reserve(BUFFER_SIZE);
+    }
+
+    BufferedOutput(const BufferedOutput&) = delete;
+    BufferedOutput& operator=(const BufferedOutput&) = delete;
+
+    ~BufferedOutput() {
+        Flush();
+    }
+
+    void Put(char c) {
+        buffer_.push_back(c);
+        FlushIfFull();
+    }
+
+    void Put(size_t count, char c) {
+        buffer_.append(count, c);
+        FlushIfFull();
+    }
+
+    void Put(std::string_view text) {
+        buffer_.append(text);
+        FlushIfFull();
+    }
+
+    void Put(FormulaError error) {
+        Put(error.ToString());
+    }
+
+//Formats the number exactly as output << value would do it
+    void Put(double value) {
+        if (default_number_format_) {
+            char chars[NUMBER_SIZE];
+            auto [end, ec] = std::to_chars(chars, chars + NUMBER_SIZE, value,
+                                           std::chars_format::general,
+                                           static_cast<int>(output_.precision()));
+            if (ec == std::errc()) {
+                Put(std::string_view(chars, end - chars));
+                return;
+            }
+        }
+        Flush();
+        output_ << value;
+    }
+
+    void Flush() {
+        output_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+        buffer_.clear();
+    }
+
+private:
+    static constexpr size_t BUFFER_SIZE = 1 << 16;
+    static constexpr size_t NUMBER_SIZE = 64;
+
+//std::to_chars matches the stream output only for the default
+//floating point format in the classic locale
+    static bool IsDefaultNumberFormat(const std::ostream& output) {
+        const auto custom_flags = std::ios_base::floatfield | std::ios_base::showpos
+                                | std::ios_base::showpoint | std::ios_base::uppercase;
+        return (output.flags() & custom_flags) == 0 && output.width() == 0
+            && output.getloc() == std::locale::classic();
+    }
+
+    void FlushIfFull() {
+        if (buffer_.size() >= BUFFER_SIZE) {
+            Flush();
+        }
+    }
+
+    std::ostream& output_;
+    const bool default_number_format_;
+    std::string buffer_;
+};
+
+//Prints the area row by row, visiting only the stored cells; the gaps
+//between them are filled with tabs, so the result is the same as if
+//every position of the area were printed. The storage provides
+//ForEachInRow() with the cells having IsEmpty(), print_cell(pos, cell, out)
+//prints a non-empty cell
+template <typename Storage, typename CellPrinter>
+void PrintArea(const Storage& cells, Size area, std::ostream& output, CellPrinter print_cell) {
+    if (area.rows == 0) {
+        return;
+    }
+    BufferedOutput out(output);
+    const size_t row_tabs = static_cast<size_t>(area.cols - 1);
+
+    for (int row = 0; row < area.rows; ++row) {
+        int current_col = 0;
+        cells.ForEachInRow(row, [&](Position pos, const auto& cell) {
+            if (pos.col >= area.cols || cell.IsEmpty()) {
+                return;
+            }
+            out.Put(static_cast<size_t>(pos.col - current_col), '\t');
+            current_col = pos.col;
+            print_cell(pos, cell, out);
+        });
+        out.Put(row_tabs - current_col, '\t');
+        out.Put('\n');
+    }
+}
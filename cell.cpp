@@ -1,171 +1,298 @@
 #include "cell.h"
 
+#include "profiler.h"
+#include "sheet.h"
+
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
 #include <iostream>
-#include <string>
 #include <optional>
+#include <string>
 
-Cell::Cell(SheetInterface& sheet)
+Cell::Cell(Sheet& sheet, Position pos)
     : sheet_(sheet)
-    , impl_(std::make_unique<EmptyImpl>())
-    , dependents_cells_()
-    , referenced_cells_()
-    , cache_value_(std::nullopt) {
+    , pos_(pos)
+    , impl_(Impl::Empty()) {
+    SheetCounters::Add(sheet_.GetCounters().cell_bytes, sizeof(Cell));
 }
 
-Cell::Cell(SheetInterface& sheet, std::string text)
-    : Cell(sheet) {
-        Set(text);
+//The cell is counted only when its text is accepted
+Cell::Cell(Sheet& sheet, Position pos, std::string text)
+    : sheet_(sheet)
+    , pos_(pos)
+    , impl_(Impl::Empty()) {
+    Set(std::move(text));
+    SheetCounters::Add(sheet_.GetCounters().cell_bytes, sizeof(Cell));
 }
 
-bool Cell::IsReferenced() const {
-    return !dependents_cells_.empty() || !referenced_cells_.empty();
+bool Cell::IsEmpty() const {
+    return impl_->IsEmpty();
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
     return impl_->GetReferencedCells();
 }
-//Add a cell position dependent from current cell
-void Cell::AddDependency(Position pos) {
-    dependents_cells_.insert(pos);
+
+FormulaReferences Cell::GetReferences() const {
+    return impl_->GetReferences();
 }
-//Add positions of dependent cells from current cell(this method is used when updating the content of an existing cell)
-//perhaps it makes sense to use the copy constructor instead
-void Cell::AddOldDependents(const std::set<Position> old_depend_cells) {
-    dependents_cells_ = old_depend_cells;
+
+DependencyGraph::NodeId Cell::GetNode() const {
+    return node_;
 }
 
-const std::set<Position>& Cell::GetDependentsCells() const {
-    return dependents_cells_;
+void Cell::SetNode(DependencyGraph::NodeId node) {
+    node_ = node;
 }
 
-void Cell::Set(std::string text) {
-    Impl::ImplType impl_type = Impl::DefineImplType(text);
-    switch(impl_type) {
-        case Impl::ImplType::FORMULA:
-            impl_ = std::make_unique<FormulaImpl>(text, sheet_);
-            break;
-        case Impl::ImplType::TEXT:
-            impl_ = std::make_unique<TextImpl>(text);
-            break;
-        case Impl::ImplType::EMPTY:
-            impl_ = std::make_unique<EmptyImpl>();
-            break;
-    }
-    cache_value_.reset();
-    ResetCacheDependentsCells();
+void Cell::ResetCache() {
+    cache_.Reset();
 }
 
-Cell::~Cell() {}
+bool Cell::HasCachedValue() const {
+    return impl_->GetType() != Impl::ImplType::FORMULA || cache_.IsReady();
+}
 
-Cell::Impl::ImplType Cell::Impl::DefineImplType(const std::string& text) {
-    if (text.empty()) {
-        return ImplType::EMPTY;
-    }
-    if (text[0] == '=') {
-        return ImplType::FORMULA;
+void Cell::CacheValue(const FormulaInterface::Value& value) const {
+    if (!cache_.IsReady()) {
+        SheetCounters::Add(sheet_.GetCounters().cache_misses);
     }
-    return ImplType::TEXT;   
+    cache_.Get([&value] {
+        return value;
+    });
 }
 
-void Cell::UpdateReferencedCells() {
-    auto ref_cells = impl_->GetReferencedCells();
-    referenced_cells_.clear();
-    referenced_cells_.insert(ref_cells.cbegin(), ref_cells.cend());
+std::shared_ptr<const Cell::Impl> Cell::GetImpl() const {
+    return impl_;
 }
-//Recursively resetting the cache value of all cells up the tree
-void Cell::ResetCacheDependentsCells() {
-    if (dependents_cells_.empty()) {
-        return;
-    }
-    for (auto depend_cell : dependents_cells_) {
-        dynamic_cast<Cell*>(sheet_.GetCell(depend_cell))->cache_value_.reset();
-        dynamic_cast<Cell*>(sheet_.GetCell(depend_cell))->ResetCacheDependentsCells();
-    }
-}
-//From the cells referenced by the current cell, we remove the fact that it depends from them
-//This method is used when updating the contents of a cell
-void Cell::RemoveOldLinks(Position pos) {
-    for (auto ref_cell : referenced_cells_) {
-        dynamic_cast<Cell*>(sheet_.GetCell(ref_cell))->dependents_cells_.erase(pos);
+
+void Cell::Set(std::string text) {
+    SheetCounters& counters = sheet_.GetCounters();
+    if (Impl::DefineImplType(text) == Impl::ImplType::EMPTY) {
+        impl_ = Impl::Empty();
+    } else {
+        bool parsed = false;
+        impl_ = std::make_shared<const Impl>(std::move(text), pos_, &parsed);
+        if (parsed) {
+            SheetCounters::Add(counters.formulas_parsed);
+        }
     }
+    SheetCounters::Add(counters.cell_bytes, impl_->GetAllocatedBytes());
+    ResetCache();
 }
 
+Cell::~Cell() {}
+
 void Cell::Clear() {
     Set("");
-    referenced_cells_.clear();
 }
 
-Cell::Value Cell::GetValue() const {
-    if (!cache_value_) {
-       cache_value_ = impl_->GetValue();
+void Cell::CountLookup() const {
+    if (impl_->GetType() == Impl::ImplType::FORMULA) {
+        SheetCounters& counters = sheet_.GetCounters();
+        SheetCounters::Add(cache_.IsReady() ? counters.cache_hits : counters.cache_misses);
     }
-    return *cache_value_;
+}
+
+Cell::Value Cell::GetValue() const {
+    CountLookup();
+    return impl_->GetValue(sheet_, cache_);
+}
+
+Cell::ValueView Cell::GetValueView() const {
+    CountLookup();
+    return impl_->GetValueView(sheet_, cache_);
 }
 
 std::string Cell::GetText() const {
     return impl_->GetText();
 }
 
+Cell::NumericValue Cell::GetNumericValue() const {
+    CountLookup();
+    return impl_->GetNumericValue(sheet_, cache_);
+}
+
 
-/////FormulaImpl/////
+/////Impl/////
 
-Cell::FormulaImpl::FormulaImpl(std::string text, const SheetInterface& sheet)
-    : sheet_(sheet)
-    , formula_(ParseFormula(text.substr(1))){ //Cutting '='
+namespace {
+//Only a whole text is a number, an escaped text never is. The forms std::stod
+//reads are numbers (leading spaces, '+', hex, inf), as long as nothing follows them
+std::optional<double> ParseNumber(const std::string& text) {
+    if (text.empty() || text.front() == ESCAPE_SIGN) {
+        return std::nullopt;
+    }
+    const char* begin = text.c_str();
+    char* end = nullptr;
+    errno = 0;
+    const double number = std::strtod(begin, &end);
+    if (end == begin || end != begin + text.size() || errno == ERANGE) {
+        return std::nullopt;
+    }
+    return number;
 }
+}  // namespace
 
-Cell::Value Cell::FormulaImpl::GetValue() const {
-    auto out_value = formula_->Evaluate(sheet_);
-    if (std::holds_alternative<double>(out_value)) {
-        return std::get<double>(out_value);
-    } else {
-        return std::get<FormulaError>(out_value);
+Cell::Impl::ImplType Cell::Impl::DefineImplType(const std::string& text) {
+    if (text.empty()) {
+        return ImplType::EMPTY;
+    }
+    if (text[0] == FORMULA_SIGN) {
+        return ImplType::FORMULA;
     }
+    return ParseNumber(text) ? ImplType::NUMBER : ImplType::TEXT;
 }
 
-std::string Cell::FormulaImpl::GetText() const {
-    return FORMULA_SIGN + formula_->GetExpression();
+const std::shared_ptr<const Cell::Impl>& Cell::Impl::Empty() {
+    static const std::shared_ptr<const Impl> empty(new Impl());
+    return empty;
 }
 
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
-    return formula_->GetReferencedCells();
+Cell::Impl::Impl(std::string text, Position pos, bool* parsed) {
+    if (text.empty()) {
+        content_ = std::monostate();
+    } else if (text[0] == FORMULA_SIGN) {
+        //Cutting '='
+        content_ = Formula{ParseSharedFormula(std::string_view(text).substr(1), pos, parsed), pos};
+    } else if (std::optional<double> number = ParseNumber(text)) {
+        content_ = Number{*number, std::move(text)};
+    } else {
+        content_ = Text{std::move(text)};
+    }
 }
 
+FormulaInterface::Value Cell::Impl::GetFormulaValue(const SheetInterface& sheet, const CachedValue& cache) const {
+    const Formula& formula = std::get<Formula>(content_);
+    PROFILE_CELL_LOOKUP(formula.pos, cache.IsReady());
+    return cache.Get([&formula, &sheet] {
+        PROFILE_CELL_EVALUATION(formula.pos);
+        return formula.formula->Evaluate(sheet, formula.pos);
+    });
+}
 
-/////TextImpl/////
+Cell::Value Cell::Impl::GetValue(const SheetInterface& sheet, const CachedValue& cache) const {
+    switch (GetType()) {
+        case ImplType::FORMULA: {
+            auto value = GetFormulaValue(sheet, cache);
+            if (const double* number = std::get_if<double>(&value)) {
+                return *number;
+            }
+            return std::get<FormulaError>(value);
+        }
+        case ImplType::TEXT: {
+            const std::string& text = std::get<Text>(content_).value;
+            if (text.front() == ESCAPE_SIGN) {
+                return text.substr(1);
+            }
+            return text;
+        }
+        case ImplType::NUMBER:
+            return std::get<Number>(content_).text;
+        case ImplType::EMPTY:
+            break;
+    }
+    return std::string();
+}
 
-Cell::TextImpl::TextImpl(std::string text)
-    :value_(std::move(text)) {
+Cell::ValueView Cell::Impl::GetValueView(const SheetInterface& sheet, const CachedValue& cache) const {
+    switch (GetType()) {
+        case ImplType::FORMULA: {
+            auto value = GetFormulaValue(sheet, cache);
+            if (const double* number = std::get_if<double>(&value)) {
+                return *number;
+            }
+            return std::get<FormulaError>(value);
+        }
+        case ImplType::TEXT: {
+            std::string_view value = std::get<Text>(content_).value;
+            if (value.front() == ESCAPE_SIGN) {
+                value.remove_prefix(1);
+            }
+            return value;
+        }
+        case ImplType::NUMBER:
+            return std::string_view(std::get<Number>(content_).text);
+        case ImplType::EMPTY:
+            break;
+    }
+    return std::string_view();
 }
 
-Cell::Value Cell::TextImpl::GetValue() const {
-    if (!value_.empty() && value_.at(0) == ESCAPE_SIGN) {
-        return value_.substr(1);
-    } else {
-        return value_;
+std::string Cell::Impl::GetText() const {
+    switch (GetType()) {
+        case ImplType::FORMULA: {
+            const Formula& formula = std::get<Formula>(content_);
+            return FORMULA_SIGN + formula.formula->GetExpression(formula.pos);
+        }
+        case ImplType::TEXT:
+            return std::get<Text>(content_).value;
+        case ImplType::NUMBER:
+            return std::get<Number>(content_).text;
+        case ImplType::EMPTY:
+            break;
     }
+    return std::string();
 }
 
-std::string Cell::TextImpl::GetText() const {
-    return value_;
+Cell::NumericValue Cell::Impl::GetNumericValue(const SheetInterface& sheet, const CachedValue& cache) const {
+    switch (GetType()) {
+        case ImplType::FORMULA: {
+            auto value = GetFormulaValue(sheet, cache);
+            if (const double* number = std::get_if<double>(&value)) {
+                return *number;
+            }
+            return std::get<FormulaError>(value);
+        }
+        case ImplType::TEXT:
+            return NoNumber::TEXT;
+        case ImplType::NUMBER:
+            return GetNumber();
+        case ImplType::EMPTY:
+            break;
+    }
+    return NoNumber::EMPTY;
 }
 
-std::vector<Position> Cell::TextImpl::GetReferencedCells() const {
+std::vector<Position> Cell::Impl::GetReferencedCells() const {
+    if (const Formula* formula = std::get_if<Formula>(&content_)) {
+        return formula->formula->GetReferencedCells(formula->pos);
+    }
     return {};
 }
 
+FormulaReferences Cell::Impl::GetReferences() const {
+    if (const Formula* formula = std::get_if<Formula>(&content_)) {
+        return formula->formula->GetReferences(formula->pos);
+    }
+    return {};
+}
 
-/////EmptyImpl/////
-
-Cell::Value Cell::EmptyImpl::GetValue() const {
-    return std::string();
+size_t Cell::Impl::GetAllocatedBytes() const {
+//The content shared by the empty cells is not allocated for them
+    return IsEmpty() ? 0 : sizeof(Impl) + GetTextBytes();
 }
 
-std::string Cell::EmptyImpl::GetText() const {
-    return std::string();
+size_t Cell::Impl::GetTextBytes() const {
+    const std::string* text = nullptr;
+    if (const Text* content = std::get_if<Text>(&content_)) {
+        text = &content->value;
+    } else if (const Number* content = std::get_if<Number>(&content_)) {
+        text = &content->text;
+    } else {
+        return 0;
+    }
+//A short text is stored inside the string object itself
+    const char* data = text->data();
+    const char* object = reinterpret_cast<const char*>(text);
+    const bool is_inline = data >= object && data < object + sizeof(*text);
+    return is_inline ? 0 : text->capacity() + 1;
 }
 
-std::vector<Position> Cell::EmptyImpl::GetReferencedCells() const {
-    return {};
-}
\ No newline at end of file
+const SharedFormula* Cell::Impl::GetSharedFormula() const {
+    if (const Formula* formula = std::get_if<Formula>(&content_)) {
+        return formula->formula.get();
+    }
+    return nullptr;
+}
@@ -1,21 +1,84 @@
 #pragma once
 
 #include "common.h"
+#include "dependency_graph.h"
 #include "formula.h"
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
-#include <optional>
+#include <memory>
 #include <string>
+#include <variant>
 #include <vector>
-#include <set>
 
 class Sheet;
 
+//The value of a formula calculated once and then shared by all the readers.
+//Readers calculating the value concurrently all get the same result, the
+//first one to switch the state from EMPTY to BUSY stores it and publishes
+//it by switching the state to READY.
+//The value is kept unpacked, the number or the category of the error,
+//so the cache takes 16 bytes
+class CachedValue {
+public:
+    using Value = FormulaInterface::Value;
+
+    template <typename Calculate>
+    Value Get(Calculate calculate) const;
+
+    //The cell is not read while it is modified, so no reader can see the reset
+    void Reset() {
+        state_.store(State::EMPTY, std::memory_order_relaxed);
+    }
+
+    bool IsReady() const {
+        return state_.load(std::memory_order_acquire) == State::READY;
+    }
+
+private:
+    enum class State : uint8_t {
+        EMPTY,
+        BUSY,
+        READY
+    };
+    mutable std::atomic<State> state_ = State::EMPTY;
+    mutable bool is_error_ = false;
+    mutable FormulaError::Category error_ = FormulaError::Category::Ref;
+    mutable double number_ = 0.0;
+};
+
+template <typename Calculate>
+CachedValue::Value CachedValue::Get(Calculate calculate) const {
+    if (state_.load(std::memory_order_acquire) == State::READY) {
+        if (is_error_) {
+            return FormulaError(error_);
+        }
+        return number_;
+    }
+    //The value does not depend on who calculates it, so a reader that lost
+    //the race to publish returns its own copy instead of waiting
+    Value value = calculate();
+    State expected = State::EMPTY;
+    if (state_.compare_exchange_strong(expected, State::BUSY, std::memory_order_acquire)) {
+        if (const double* number = std::get_if<double>(&value)) {
+            is_error_ = false;
+            number_ = *number;
+        } else {
+            is_error_ = true;
+            error_ = std::get<FormulaError>(value).GetCategory();
+        }
+        state_.store(State::READY, std::memory_order_release);
+    }
+    return value;
+}
+
 class Cell : public CellInterface {
 public:
-    Cell(SheetInterface& sheet);
+    //An empty cell, it allocates nothing for its content
+    Cell(Sheet& sheet, Position pos);
 
-    Cell(SheetInterface& sheet, std::string text);
+    Cell(Sheet& sheet, Position pos, std::string text);
 
     void Set(std::string text);
 
@@ -23,98 +86,142 @@ public:
 
     Value GetValue() const override;
 
+    ValueView GetValueView() const override;
+
     std::string GetText() const override;
 
+    NumericValue GetNumericValue() const override;
+
     std::vector<Position> GetReferencedCells() const override;
 
-    bool IsReferenced() const;
+//References as the dependency graph keeps them, the ranges are not expanded
+    FormulaReferences GetReferences() const;
+
+    bool IsEmpty() const;
 
-    void AddDependency(Position pos);
+    //Node of the cell in the dependency graph of the sheet
+    DependencyGraph::NodeId GetNode() const;
 
-    void RemoveOldLinks(Position pos);
+    void SetNode(DependencyGraph::NodeId node);
 
-    void AddOldDependents(const std::set<Position> old_depend_cells);
+    void ResetCache();
 
-    const std::set<Position>& GetDependentsCells() const;
+    //A text or an empty cell has nothing to calculate, so it always has its value
+    bool HasCachedValue() const;
 
-    void UpdateReferencedCells();
+    //Caches the value of the formula of the cell calculated outside of it,
+    //together with the other cells sharing the formula
+    void CacheValue(const FormulaInterface::Value& value) const;
 
     ~Cell();
-private:
+
+//The content of the cell: the text or the formula. It does not change
+//after it is created, so it is shared with the snapshots of the sheet.
+//The kinds of the content are a tagged union dispatched by a switch,
+//and all the empty cells share one content
     class Impl {
     public:
         enum class ImplType {
             FORMULA,
             TEXT,
-            EMPTY
+            EMPTY,
+            //A text that is a whole number, it is kept as the number
+            //and its original text
+            NUMBER
         };
 
         static ImplType DefineImplType(const std::string& text);
 
-        virtual Value GetValue() const = 0;
+        //The content shared by the empty cells
+        static const std::shared_ptr<const Impl>& Empty();
 
-        virtual std::string GetText() const = 0;
-        
-        virtual std::vector<Position> GetReferencedCells() const = 0;
+        //The text is classified by DefineImplType(). A formula is parsed for the
+        //cell at pos or taken from the FormulaCache, *parsed is set to true if
+        //it was parsed. Throws FormulaException if the formula is incorrect
+        Impl(std::string text, Position pos, bool* parsed = nullptr);
 
-        virtual ~Impl() = default;
-    };
+        ImplType GetType() const {
+            return static_cast<ImplType>(content_.index());
+        }
 
-    class EmptyImpl : public Impl {
-    public:
-        EmptyImpl() = default;
-        
-        virtual Value GetValue() const override;
+        bool IsEmpty() const {
+            return GetType() == ImplType::EMPTY;
+        }
 
-        virtual std::string GetText() const override;
+        //The value of a formula is taken from the cache of the cell or
+        //calculated and cached, its references are resolved in the given sheet
+        Value GetValue(const SheetInterface& sheet, const CachedValue& cache) const;
 
-        std::vector<Position> GetReferencedCells() const override;
+        //The value of a formula is taken from the cache of the cell, a text is
+        //viewed in place
+        ValueView GetValueView(const SheetInterface& sheet, const CachedValue& cache) const;
 
-        virtual ~EmptyImpl() override = default;
-    };
+        std::string GetText() const;
 
-    class TextImpl : public Impl {
-    public:
-        TextImpl(std::string text);
+        //The value of a formula is taken from the cache of the cell
+        NumericValue GetNumericValue(const SheetInterface& sheet, const CachedValue& cache) const;
+
+        std::vector<Position> GetReferencedCells() const;
 
-        virtual Value GetValue() const override;
+        FormulaReferences GetReferences() const;
 
-        virtual std::string GetText() const override;
+        //Bytes allocated for the content; a parsed formula is shared through
+        //the FormulaCache, so it is not included
+        size_t GetAllocatedBytes() const;
 
-        std::vector<Position> GetReferencedCells() const override;
+        //The part of GetAllocatedBytes() taken by the characters of a text
+        //or of the text of a number
+        size_t GetTextBytes() const;
 
-        virtual ~TextImpl() override = default;
+        //The number of a NUMBER cell, read by the formulas without conversion
+        double GetNumber() const {
+            return std::get<Number>(content_).value;
+        }
+
+        //The parsed formula shared by the cells with the same relative formula
+        const SharedFormula* GetSharedFormula() const;
 
     private:
-        std::string value_;
-    };
+        struct Text {
+            std::string value;
+        };
 
-    class FormulaImpl : public Impl {
-    public:
-        FormulaImpl(std::string text, const SheetInterface& sheet);
+        //The number is parsed once, the text is kept for GetText()
+        //and the string value
+        struct Number {
+            double value;
+            std::string text;
+        };
 
-        virtual Value GetValue() const override;
+        //Parsed formulas are shared between all the cells with the same relative
+        //formula, the cell keeps only its position to resolve the references
+        struct Formula {
+            std::shared_ptr<const SharedFormula> formula;
+            Position pos;
+        };
 
-        virtual std::string GetText() const override;
+        Impl()
+            : content_(std::monostate()) {
+        }
 
-        std::vector<Position> GetReferencedCells() const override;
+        FormulaInterface::Value GetFormulaValue(const SheetInterface& sheet, const CachedValue& cache) const;
 
-        virtual ~FormulaImpl() override = default;
-    private:
-        const SheetInterface& sheet_;
-        std::unique_ptr<FormulaInterface> formula_;
+        //The alternatives are in the order of ImplType
+        std::variant<Formula, Text, std::monostate, Number> content_;
     };
 
+    std::shared_ptr<const Impl> GetImpl() const;
+
 private:
-    void ResetCacheDependentsCells();
-   
-    SheetInterface& sheet_;  
+    //Counts the reads of formula values in the statistics of the sheet
+    void CountLookup() const;
+
+    Sheet& sheet_;  
+    Position pos_;
      
-    std::unique_ptr<Impl> impl_;          
-//Schematic representation of dependencies: referenced_cells_<---ACTUAL_CELL<---dependents_cells_
-//ACTUAL_CELL - current cell
-    std::set<Position> dependents_cells_;    
-    std::set<Position> referenced_cells_;      
+    std::shared_ptr<const Impl> impl_;          
+//Dependencies of the cell are kept by the sheet in its DependencyGraph
+    DependencyGraph::NodeId node_ = 0;
     
-    mutable std::optional<Value> cache_value_;  
+    CachedValue cache_;
 };
\ No newline at end of file
@@ -1,10 +1,12 @@
 #pragma once
 
+#include <functional>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -33,6 +35,20 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Rectangular range of cells, e.g. A1:B100. Both corners are included,
+// first is the top left corner and last is the bottom right one.
+struct CellRange {
+    Position first;
+    Position last;
+
+    bool operator==(CellRange rhs) const;
+    bool operator<(CellRange rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    std::string ToString() const;
+};
+
 // Describes errors that may occur during calculating a formula.
 class FormulaError {
 public:
@@ -81,6 +97,18 @@ public:
     // The cell text, or the formula value, or an error message from
     // formula
     using Value = std::variant<std::string, double, FormulaError>;
+    // The value of the cell without a copy of its text: the view points into
+    // the cell and is valid until the cell is changed
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
+
+    // The kinds of cells which have no number for a formula
+    enum class NoNumber {
+        EMPTY,
+        TEXT,  // a text which is not a number, or an escaped text
+    };
+    // The cell as an operand of a formula: the number of a formula or of a text,
+    // the error of a formula, or the reason the cell has no number
+    using NumericValue = std::variant<double, FormulaError, NoNumber>;
 
     virtual ~CellInterface() = default;
 
@@ -89,13 +117,19 @@ public:
     // In the case of a formula, this is the numerical value of the formula
     // or an error message.
     virtual Value GetValue() const = 0;
+    // The same value as GetValue() returns, without allocations
+    virtual ValueView GetValueView() const = 0;
     // Returns the internal text of the cell, as if we had started editing it.
     // In the case of a text cell, it is text (possibly containing escape characters).
     // In the case of a formula, it is expression.
     virtual std::string GetText() const = 0;
+    // Returns the value of the cell as formulas read it. The number of a text
+    // is found once, when the text is set, so reading it copies no strings.
+    virtual NumericValue GetNumericValue() const = 0;
 
     // Returns a list of cells that are directly involved in this formula.
     // The list is sorted in ascending order and does not contain duplicate cells.
+    // The cells of the ranges of the formula are not included.
     // In the case of a text cell, the list is empty.
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
@@ -104,6 +138,13 @@ inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
 // Sheet Interface
+//
+// Concurrent reads: the const methods of the sheet and of its cells
+// (GetCell(), GetValue(), GetText(), GetReferencedCells(), GetPrintableSize(),
+// PrintValues(), PrintTexts()) may be called from any number of threads at once,
+// as long as no thread modifies the sheet (SetCell(), ClearCell(), Recalculate(),
+// Snapshot()) at the same time. The values calculated by the readers are cached
+// without locks. To keep reading while the sheet is modified, read a Snapshot().
 class SheetInterface {
 public:
     virtual ~SheetInterface() = default;
@@ -123,11 +164,25 @@ public:
     // start text with a sign "=", but so that it is not interpreted as a formula.
     virtual void SetCell(Position pos, std::string text) = 0;
 
+    // Sets the contents of many cells as one change; a later text for the same
+    // position overwrites an earlier one. The texts are parsed on the given number
+    // of threads (zero means all hardware threads), the whole batch is checked for
+    // cycles at once and every affected value is reset once. If any text is
+    // rejected with one of the exceptions of SetCell(), the sheet is not changed.
+    virtual void SetCells(const std::vector<std::pair<Position, std::string>>& cells,
+                          size_t threads = 0) = 0;
+
     // Return the cell value.
     // If cell is empty, return nullptr.
     virtual const CellInterface* GetCell(Position pos) const = 0;
     virtual CellInterface* GetCell(Position pos) = 0;
 
+    // Calls func(pos, cell) for every cell of the valid range in row-major order.
+    // Only the stored cells are visited, so it takes time proportional to their
+    // number rather than to the area of the range.
+    virtual void ForEachCellInRange(CellRange range,
+                                    const std::function<void(Position, const CellInterface&)>& func) const = 0;
+
     // Clear cell.
     // Next call GetCell() for current cell return nullptr or
     // object with empty text.
@@ -144,6 +199,21 @@ public:
     // or GetText(). An empty cell is always interpreted by an empty.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Calculates the values of all the cells changed or affected by the changes
+    // since the last calculation. The cells are calculated level by level, the
+    // independent cells of a level in parallel on the given number of threads
+    // (zero means all hardware threads). Otherwise the values are calculated on
+    // demand by GetValue() on the calling thread; the values are the same.
+    virtual void Recalculate(size_t threads = 0) = 0;
+
+    // Returns a read-only view of the current state of the sheet, the later changes
+    // of the sheet are not visible in it. The snapshot may be read on other threads
+    // while the sheet keeps changing; it calculates and caches its own values.
+    // It shares the unchanged tiles with the sheet, so creating it costs O(1) (the
+    // first snapshot of a sheet costs O(cells)) and the changes made after it
+    // cost O(changed tiles).
+    virtual std::shared_ptr<const SheetInterface> Snapshot() = 0;
 };
 
 // Creates a ready-to-use empty table.
@@ -0,0 +1,227 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+#include <cassert>
+
+DependencyGraph::NodeId DependencyGraph::AddNode(Position pos, int64_t order) {
+    NodeId node;
+    if (!free_nodes_.empty()) {
+        node = free_nodes_.back();
+        free_nodes_.pop_back();
+    } else {
+        node = static_cast<NodeId>(nodes_.size());
+        nodes_.emplace_back();
+        marks_.push_back(0);
+        waiting_.push_back(0);
+        CountAllocation(sizeof(Node) + sizeof(uint32_t) * 2);
+    }
+    nodes_[node].pos = pos;
+    nodes_[node].order = order;
+    positions_.Put(pos, position_pool_.New(node));
+    CountAllocation(sizeof(NodeId));
+
+//The nodes whose ranges cover the position reference the new node; it has
+//no references yet, so moving it before them cannot find a cycle
+    ForEachDependentLink(node, [this, node](NodeId dependent) {
+        if (nodes_[dependent].order < nodes_[node].order) {
+            RestoreOrder(dependent, {node});
+        }
+    });
+    return node;
+}
+
+void DependencyGraph::RemoveNode(NodeId node) {
+    assert(nodes_[node].references.empty() && nodes_[node].ranges.empty() && nodes_[node].dependents.empty());
+    positions_.Take(nodes_[node].pos);
+    free_nodes_.push_back(node);
+}
+
+void DependencyGraph::SetReferences(NodeId node, std::vector<NodeId> references, std::vector<CellRange> ranges) {
+//The order of the dependents does not matter, so a link is removed
+//by moving the last one into its place
+    for (NodeId reference : nodes_[node].references) {
+        auto& dependents = nodes_[reference].dependents;
+        auto it = std::find(dependents.begin(), dependents.end(), node);
+        *it = dependents.back();
+        dependents.pop_back();
+    }
+    for (NodeId reference : references) {
+        nodes_[reference].dependents.push_back(node);
+    }
+//Every reference is kept in both directions
+    CountAllocation(references.size() * sizeof(NodeId) * 2 + ranges.size() * sizeof(CellRange));
+    nodes_[node].references = std::move(references);
+
+    IndexRanges(node, false);
+    nodes_[node].ranges = std::move(ranges);
+    IndexRanges(node, true);
+}
+
+void DependencyGraph::AddReferences(NodeId node, const std::vector<NodeId>& references) {
+    for (NodeId reference : references) {
+        nodes_[reference].dependents.push_back(node);
+    }
+    CountAllocation(references.size() * sizeof(NodeId) * 2);
+    auto& node_references = nodes_[node].references;
+    node_references.insert(node_references.end(), references.begin(), references.end());
+}
+
+void DependencyGraph::RestoreOrder(NodeId node, const std::vector<NodeId>& references,
+                                   const std::vector<CellRange>& ranges) {
+    std::vector<NodeId> misplaced;
+    int64_t upper_bound = 0;
+    auto check = [&](NodeId reference) {
+        if (reference == node) {
+            throw CircularDependencyException("");
+        }
+        if (nodes_[reference].order > nodes_[node].order) {
+            misplaced.push_back(reference);
+            upper_bound = std::max(upper_bound, nodes_[reference].order);
+        }
+    };
+    for (NodeId reference : references) {
+        check(reference);
+    }
+    for (CellRange range : ranges) {
+        positions_.ForEachInRange(range, [&check](Position, NodeId reference) {
+            check(reference);
+        });
+    }
+    if (misplaced.empty()) {
+        return;
+    }
+
+//A cycle exists only if a misplaced reference depends on the node; the path
+//to it goes through the nodes ordered between the node and the reference
+    const int64_t lower_bound = nodes_[node].order;
+    std::vector<NodeId> forward;
+    const uint32_t forward_walk = NextWalk();
+    CollectOrderedBetween<true>({node}, lower_bound, upper_bound, forward_walk, forward);
+    cycle_check_visits_.fetch_add(forward.size(), std::memory_order_relaxed);
+    for (NodeId reference : misplaced) {
+        if (marks_[reference] == forward_walk) {
+            throw CircularDependencyException("");
+        }
+    }
+    std::vector<NodeId> backward;
+    CollectOrderedBetween<false>(std::move(misplaced), lower_bound + 1, upper_bound, NextWalk(), backward);
+    cycle_check_visits_.fetch_add(backward.size(), std::memory_order_relaxed);
+
+//The nodes found are given the same set of orders: the references
+//and their ancestors first, the node and its descendants after them
+    auto by_order = [this](NodeId lhs, NodeId rhs) {
+        return nodes_[lhs].order < nodes_[rhs].order;
+    };
+    std::sort(backward.begin(), backward.end(), by_order);
+    std::sort(forward.begin(), forward.end(), by_order);
+    std::vector<int64_t> orders;
+    orders.reserve(backward.size() + forward.size());
+    for (NodeId moved : backward) {
+        orders.push_back(nodes_[moved].order);
+    }
+    for (NodeId moved : forward) {
+        orders.push_back(nodes_[moved].order);
+    }
+    std::sort(orders.begin(), orders.end());
+    auto order = orders.begin();
+    for (NodeId moved : backward) {
+        nodes_[moved].order = *order++;
+    }
+    for (NodeId moved : forward) {
+        nodes_[moved].order = *order++;
+    }
+}
+
+void DependencyGraph::IndexRanges(NodeId node, bool add) {
+    std::vector<uint32_t> tiles;
+    bool has_large_range = false;
+    for (CellRange range : nodes_[node].ranges) {
+        if (IsLargeRange(range)) {
+            has_large_range = true;
+            continue;
+        }
+        for (int tile_row = range.first.row / TILE_SIZE; tile_row <= range.last.row / TILE_SIZE; ++tile_row) {
+            for (int tile_col = range.first.col / TILE_SIZE; tile_col <= range.last.col / TILE_SIZE; ++tile_col) {
+                tiles.push_back(TileKey(tile_row, tile_col));
+            }
+        }
+    }
+//A node is listed in a tile once, however many of its ranges cover it
+    std::sort(tiles.begin(), tiles.end());
+    tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+    for (uint32_t tile : tiles) {
+        if (add) {
+            ranges_by_tile_[tile].push_back(node);
+            CountAllocation(sizeof(NodeId));
+            continue;
+        }
+        auto& nodes = ranges_by_tile_[tile];
+        auto it = std::find(nodes.begin(), nodes.end(), node);
+        *it = nodes.back();
+        nodes.pop_back();
+        if (nodes.empty()) {
+            ranges_by_tile_.erase(tile);
+        }
+    }
+    if (!has_large_range) {
+        return;
+    }
+    if (add) {
+        large_range_nodes_.push_back(node);
+        CountAllocation(sizeof(NodeId));
+        return;
+    }
+    auto it = std::find(large_range_nodes_.begin(), large_range_nodes_.end(), node);
+    *it = large_range_nodes_.back();
+    large_range_nodes_.pop_back();
+}
+
+size_t DependencyGraph::GetMemoryUsage() const {
+    size_t bytes = sizeof(*this) + nodes_.capacity() * sizeof(Node)
+                   + (free_nodes_.capacity() + large_range_nodes_.capacity()) * sizeof(NodeId)
+                   + (marks_.capacity() + waiting_.capacity()) * sizeof(uint32_t);
+    for (const Node& node : nodes_) {
+        bytes += (node.references.capacity() + node.dependents.capacity()) * sizeof(NodeId)
+                 + node.ranges.capacity() * sizeof(CellRange);
+    }
+    bytes += positions_.GetMemoryUsage() - sizeof(positions_) + position_pool_.GetMemoryUsage();
+//A node of the hash map holds the key, the vector and the link to the next node
+    bytes += ranges_by_tile_.bucket_count() * sizeof(void*);
+    for (const auto& [tile, nodes] : ranges_by_tile_) {
+        bytes += sizeof(std::pair<const uint32_t, std::vector<NodeId>>) + sizeof(void*)
+                 + nodes.capacity() * sizeof(NodeId);
+    }
+    return bytes;
+}
+
+uint32_t DependencyGraph::NextWalk() {
+//After the counter wraps around old marks could match a new walk
+    if (++last_walk_ == 0) {
+        std::fill(marks_.begin(), marks_.end(), 0);
+        last_walk_ = 1;
+    }
+    return last_walk_;
+}
+
+template <bool Forward>
+void DependencyGraph::CollectOrderedBetween(std::vector<NodeId> to_visit, int64_t lower, int64_t upper,
+                                            uint32_t walk, std::vector<NodeId>& found) {
+    while (!to_visit.empty()) {
+        const NodeId current = to_visit.back();
+        to_visit.pop_back();
+        const Node& current_node = nodes_[current];
+        if (marks_[current] == walk || current_node.order < lower || current_node.order > upper) {
+            continue;
+        }
+        marks_[current] = walk;
+        found.push_back(current);
+        auto visit = [&to_visit](NodeId link) {
+            to_visit.push_back(link);
+        };
+        if constexpr (Forward) {
+            ForEachDependentLink(current, visit);
+        } else {
+            ForEachReferenceLink(current, visit);
+        }
+    }
+}
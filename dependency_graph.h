@@ -0,0 +1,284 @@
+#pragma once
+
+#include "common.h"
+#include "object_pool.h"
+#include "tiled_storage.h"
+
+#include <atomic>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Dependencies between the cells of a sheet.
+// Every stored cell is a node with a dense integer id; ids of removed nodes are
+// reused. Edges are kept in per-node arrays of ids in both directions:
+// references (cells the formula reads) and dependents (cells reading this one),
+// so every walk over the graph is a walk over arrays of 4-byte ids.
+// A range reference (A1:B100) is a single range edge: the node keeps the range
+// and is found by the position of a cell through an index of the ranges by tile,
+// so it references every node inside the range, including the ones added later,
+// without an edge per cell. A range covering many tiles (a whole column or the
+// whole sheet) is not indexed by tile, its node is kept in a short list checked
+// for every cell instead.
+// The nodes are kept in a topological order: a node is always ordered after
+// the nodes it references (see RestoreOrder()).
+class DependencyGraph {
+public:
+    using NodeId = uint32_t;
+
+    // Adds a node without references. The order must not break the topological
+    // order for the direct dependents; a node added inside the ranges of other
+    // nodes is moved before them
+    NodeId AddNode(Position pos, int64_t order);
+
+    // Removes a node, it must have no references and no direct dependents
+    void RemoveNode(NodeId node);
+
+    Position GetPosition(NodeId node) const {
+        return nodes_[node].pos;
+    }
+
+    int64_t GetOrder(NodeId node) const {
+        return nodes_[node].order;
+    }
+
+    const std::vector<NodeId>& GetReferences(NodeId node) const {
+        return nodes_[node].references;
+    }
+
+    const std::vector<CellRange>& GetRanges(NodeId node) const {
+        return nodes_[node].ranges;
+    }
+
+    // Direct dependents only, the nodes whose ranges cover the node are not included
+    const std::vector<NodeId>& GetDependents(NodeId node) const {
+        return nodes_[node].dependents;
+    }
+
+    // Replaces the references and the ranges of the node; RestoreOrder() must be
+    // called for the new ones first
+    void SetReferences(NodeId node, std::vector<NodeId> references, std::vector<CellRange> ranges = {});
+
+    // Adds references to the node, keeping the ones it has; RestoreOrder() must
+    // be called for them first unless they are ordered before the node
+    void AddReferences(NodeId node, const std::vector<NodeId>& references);
+
+    // Throws CircularDependencyException if the node referencing the given nodes
+    // and the nodes inside the given ranges would create a cycle. Otherwise restores
+    // the topological order for these references, moving only the nodes ordered
+    // between the ends of the misplaced references (Pearce-Kelly)
+    void RestoreOrder(NodeId node, const std::vector<NodeId>& references,
+                      const std::vector<CellRange>& ranges = {});
+
+    // Splits the given nodes and the nodes they reference directly or through
+    // other nodes, as long as needs_level(node) is true, into levels: the nodes
+    // of a level reference only the nodes of the previous levels and the nodes
+    // for which needs_level() is false. The given nodes must satisfy needs_level
+    template <typename Pred>
+    std::vector<std::vector<NodeId>> Levelize(const std::vector<NodeId>& nodes, Pred needs_level);
+
+    // Calls func(node) once for every node depending on the given ones directly
+    // or through other nodes
+    template <typename Func>
+    void ForEachDependent(const std::vector<NodeId>& nodes, Func func);
+
+    // Nodes visited by RestoreOrder() since the graph was created
+    uint64_t GetCycleCheckVisits() const {
+        return cycle_check_visits_.load(std::memory_order_relaxed);
+    }
+
+    // Bytes allocated for the nodes, the edges and the indexes since the graph
+    // was created, the released ones included
+    uint64_t GetAllocatedBytes() const {
+        return allocated_bytes_.load(std::memory_order_relaxed) + positions_.GetAllocatedBytes();
+    }
+
+    // Bytes held by the graph now: the nodes, their edges, the position and
+    // the range indexes and the marks of the walks
+    size_t GetMemoryUsage() const;
+
+private:
+    struct Node {
+        Position pos;
+        int64_t order = 0;
+        std::vector<NodeId> references;
+        std::vector<CellRange> ranges;
+        std::vector<NodeId> dependents;
+    };
+
+    static constexpr int TILE_SIZE = TiledStorage<NodeId>::TILE_SIZE;
+    // a range covering more tiles is a large range, see large_range_nodes_
+    static constexpr int MAX_INDEXED_TILES = 16;
+
+    static bool IsLargeRange(CellRange range) {
+        const int tile_rows = range.last.row / TILE_SIZE - range.first.row / TILE_SIZE + 1;
+        const int tile_cols = range.last.col / TILE_SIZE - range.first.col / TILE_SIZE + 1;
+        return tile_rows * tile_cols > MAX_INDEXED_TILES;
+    }
+
+    // Calls func(reference) for every link to the references of the node: the
+    // nodes referenced directly and the nodes inside its ranges, a node inside
+    // two ranges is passed twice
+    template <typename Func>
+    void ForEachReferenceLink(NodeId node, Func&& func) const;
+
+    // Calls func(dependent) for every link to the dependents of the node, the
+    // same links ForEachReferenceLink() passes in the other direction
+    template <typename Func>
+    void ForEachDependentLink(NodeId node, Func&& func) const;
+
+    // Adds the node to or removes it from the index of the tiles its ranges cover
+    // and the list of the nodes with large ranges
+    void IndexRanges(NodeId node, bool add);
+
+    static uint32_t TileKey(int tile_row, int tile_col) {
+        return static_cast<uint32_t>(tile_row) * TiledStorage<NodeId>::TILE_COLS + tile_col;
+    }
+
+    // Starts a new walk, a node is visited in it if its mark equals the result
+    uint32_t NextWalk();
+
+    // The counters are read by the statistics of the sheet on other threads
+    void CountAllocation(uint64_t bytes) {
+        allocated_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    // Marks the nodes reachable from the start ones through the nodes with the
+    // order in [lower, upper] and appends them to found
+    template <bool Forward>
+    void CollectOrderedBetween(std::vector<NodeId> to_visit, int64_t lower, int64_t upper,
+                               uint32_t walk, std::vector<NodeId>& found);
+
+    std::vector<Node> nodes_;
+    std::vector<NodeId> free_nodes_;
+    // the nodes by position, to find the nodes inside a range
+    ObjectPool<NodeId> position_pool_;
+    TiledStorage<NodeId, ObjectPool<NodeId>::Deleter> positions_{ObjectPool<NodeId>::Deleter{&position_pool_}};
+    // the nodes with a range covering some cell of the tile, by TileKey()
+    std::unordered_map<uint32_t, std::vector<NodeId>> ranges_by_tile_;
+    // the nodes with a large range, a node is listed once
+    std::vector<NodeId> large_range_nodes_;
+    std::vector<uint32_t> marks_;
+    // used by Levelize() for the nodes marked by its walk
+    std::vector<uint32_t> waiting_;
+    uint32_t last_walk_ = 0;
+    std::atomic<uint64_t> cycle_check_visits_{0};
+    std::atomic<uint64_t> allocated_bytes_{0};
+};
+
+template <typename Func>
+void DependencyGraph::ForEachReferenceLink(NodeId node, Func&& func) const {
+    const Node& current = nodes_[node];
+    for (NodeId reference : current.references) {
+        func(reference);
+    }
+    for (CellRange range : current.ranges) {
+        positions_.ForEachInRange(range, [&func](Position, NodeId reference) {
+            func(reference);
+        });
+    }
+}
+
+template <typename Func>
+void DependencyGraph::ForEachDependentLink(NodeId node, Func&& func) const {
+    const Node& current = nodes_[node];
+    for (NodeId dependent : current.dependents) {
+        func(dependent);
+    }
+    auto tile = ranges_by_tile_.find(TileKey(current.pos.row / TILE_SIZE, current.pos.col / TILE_SIZE));
+    if (tile != ranges_by_tile_.end()) {
+        for (NodeId dependent : tile->second) {
+            for (CellRange range : nodes_[dependent].ranges) {
+                if (!IsLargeRange(range) && range.Contains(current.pos)) {
+                    func(dependent);
+                }
+            }
+        }
+    }
+    for (NodeId dependent : large_range_nodes_) {
+        for (CellRange range : nodes_[dependent].ranges) {
+            if (IsLargeRange(range) && range.Contains(current.pos)) {
+                func(dependent);
+            }
+        }
+    }
+}
+
+template <typename Func>
+void DependencyGraph::ForEachDependent(const std::vector<NodeId>& nodes, Func func) {
+    const uint32_t walk = NextWalk();
+    std::vector<NodeId> to_visit;
+    auto visit = [this, walk, &to_visit](NodeId dependent) {
+        if (marks_[dependent] != walk) {
+            marks_[dependent] = walk;
+            to_visit.push_back(dependent);
+        }
+    };
+    for (NodeId node : nodes) {
+        ForEachDependentLink(node, visit);
+    }
+    while (!to_visit.empty()) {
+        const NodeId current = to_visit.back();
+        to_visit.pop_back();
+        func(current);
+        ForEachDependentLink(current, visit);
+    }
+}
+
+template <typename Pred>
+std::vector<std::vector<DependencyGraph::NodeId>> DependencyGraph::Levelize(const std::vector<NodeId>& nodes,
+                                                                            Pred needs_level) {
+    const uint32_t walk = NextWalk();
+    std::vector<NodeId> found;
+    std::vector<NodeId> to_visit;
+    for (NodeId node : nodes) {
+        if (marks_[node] != walk) {
+            marks_[node] = walk;
+            to_visit.push_back(node);
+        }
+    }
+    while (!to_visit.empty()) {
+        const NodeId current = to_visit.back();
+        to_visit.pop_back();
+        found.push_back(current);
+        ForEachReferenceLink(current, [&](NodeId reference) {
+            if (marks_[reference] != walk && needs_level(reference)) {
+                marks_[reference] = walk;
+                to_visit.push_back(reference);
+            }
+        });
+    }
+
+//The levels are built as in Kahn's algorithm: a node goes to the next level
+//when the last of its references in the set is placed, waiting_ counts the
+//references not placed yet
+    if (found.empty()) {
+        return {};
+    }
+    std::vector<std::vector<NodeId>> levels(1);
+    for (NodeId node : found) {
+        uint32_t waiting = 0;
+        ForEachReferenceLink(node, [&](NodeId reference) {
+            waiting += marks_[reference] == walk;
+        });
+        waiting_[node] = waiting;
+        if (waiting == 0) {
+            levels[0].push_back(node);
+        }
+    }
+    while (true) {
+        std::vector<NodeId> next_level;
+        for (NodeId node : levels.back()) {
+            ForEachDependentLink(node, [&](NodeId dependent) {
+                if (marks_[dependent] == walk && --waiting_[dependent] == 0) {
+                    next_level.push_back(dependent);
+                }
+            });
+        }
+        if (next_level.empty()) {
+            break;
+        }
+        levels.push_back(std::move(next_level));
+    }
+    return levels;
+}
@@ -5,53 +5,88 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <optional>
 #include <sstream>
-#include <set>
 
 using namespace std::literals;
 
 namespace {
+    //Interpretation of the cell value as an operand of a formula
+    ExecuteResult InterpretCell(const SheetInterface& sheet, Position pos) {
+        const CellInterface* cell = sheet.GetCell(pos);
+        //Interpretation of an uninitialized cell
+        if (cell == nullptr) {
+            return 0.0;
+        }
+        auto value = cell->GetNumericValue();
+        if (const double* number = std::get_if<double>(&value)) {
+            return *number;
+        } else if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+            return *error;
+        }
+        //An empty cell is interpreted as double 0.0, a text that is not a number
+        //(escaped text included) only as a text
+        if (std::get<CellInterface::NoNumber>(value) == CellInterface::NoNumber::EMPTY) {
+            return 0.0;
+        }
+        return FormulaError(FormulaError::Category::Value); //Display #VALUE!
+    }
+
+    //Interpretation of the cells of a range as the numbers of an aggregate function:
+    //the cells that are not numbers are skipped, errors are still passed on.
+    //Only the stored cells are visited, the others are empty
+    std::optional<FormulaError> InterpretRange(const SheetInterface& sheet, CellRange range,
+                                               std::vector<double>& numbers) {
+        std::optional<FormulaError> error;
+        sheet.ForEachCellInRange(range, [&numbers, &error](Position, const CellInterface& cell) {
+            //The first error in row-major order is the result, the rest is not read
+            if (error) {
+                return;
+            }
+            auto value = cell.GetNumericValue();
+            if (const double* number = std::get_if<double>(&value)) {
+                numbers.push_back(*number);
+            } else if (const FormulaError* cell_error = std::get_if<FormulaError>(&value)) {
+                error = *cell_error;
+            }
+        });
+        return error;
+    }
+
+    InterpretRangeFunc MakeRangeInterpreter(const SheetInterface& sheet) {
+        return [&sheet](CellRange range, std::vector<double>& numbers) {
+            return InterpretRange(sheet, range, numbers);
+        };
+    }
+
+    FormulaReferences UniqueReferences(const FormulaAST& ast) {
+        const auto& positions = ast.GetCells();
+        FormulaReferences references;
+        references.cells.assign(positions.begin(), positions.end());  // already sorted
+        auto& cells = references.cells;
+        cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+        const auto& ranges = ast.GetRanges();
+        references.ranges.assign(ranges.begin(), ranges.end());  // already sorted
+        auto& unique_ranges = references.ranges;
+        unique_ranges.erase(std::unique(unique_ranges.begin(), unique_ranges.end()), unique_ranges.end());
+        return references;
+    }
+
+    CellRange ShiftRange(CellRange range, Position offset) {
+        return {{range.first.row + offset.row, range.first.col + offset.col},
+                {range.last.row + offset.row, range.last.col + offset.col}};
+    }
+
     class Formula : public FormulaInterface {
     public:
         explicit Formula(std::string expression) : ast_(ParseFormulaAST(expression)) {
         }
 
         Value Evaluate(const SheetInterface& sheet) const override {
-            std::function<double(Position)> interpret_function = [&sheet](Position pos) {
-                //Interpretation of an uninitialized cell
-                if (sheet.GetCell(pos) == nullptr) {                                    
-                    return 0.0;
-                }
-                auto value = sheet.GetCell(pos)->GetValue();
-                //Interpretation of a cell containing a number
-                if (std::holds_alternative<double>(value)) {
-                    return std::get<double>(value);
-                } else if (std::holds_alternative<std::string>(value)) {
-                    std::string text = sheet.GetCell(pos)->GetText();
-                //Empty text is also interpreted as double 0.0
-                    if (text.empty()) {
-                        return 0.0;
-                    }
-                //We throw an exception that this can only be interpreted as a text
-                    if (text.front() == ESCAPE_SIGN) {
-                        throw FormulaError(FormulaError::Category::Value); //Display #VALUE!
-                    }
-                //Trying to convert text to double
-                    try {
-                        return std::stod(text);
-                    } catch (...) { 
-                        throw FormulaError(FormulaError::Category::Value); //Display #VALUE!
-                    }
-                } else {
-                    throw std::get<FormulaError>(value);
-                }
+            InterpretFunc interpret_function = [&sheet](Position pos) {
+                return InterpretCell(sheet, pos);
             };
-
-            try {
-                return ast_.Execute(interpret_function);
-            } catch (const FormulaError& fe) {
-                return fe;
-            }
+            return ast_.Execute(interpret_function, MakeRangeInterpreter(sheet));
         }
 
         std::string GetExpression() const override {
@@ -61,9 +96,11 @@ namespace {
         }
 
         std::vector<Position> GetReferencedCells() const override {
-            auto positions = ast_.GetCells();
-            std::set<Position> uniq_ref_cells(positions.begin(), positions.end());
-            return {uniq_ref_cells.begin(), uniq_ref_cells.end()};
+            return UniqueReferences(ast_).cells;
+        }
+
+        FormulaReferences GetReferences() const override {
+            return UniqueReferences(ast_);
         }
 
         virtual ~Formula() override = default;
@@ -72,6 +109,70 @@ namespace {
         FormulaAST ast_;
     };
 
+    //The AST of the formula keeps references as offsets from the cell
+    //the formula is written in, the cell position is added back on every use
+    class RelativeFormula : public SharedFormula {
+    public:
+        RelativeFormula(std::string_view expression, Position cell)
+            : ast_(ParseFormulaAST(std::string(expression))) {
+            ast_.Shift({-cell.row, -cell.col});
+            offsets_ = UniqueReferences(ast_);
+        }
+
+        Value Evaluate(const SheetInterface& sheet, Position cell) const override {
+            InterpretFunc interpret_function = [&sheet](Position pos) {
+                return InterpretCell(sheet, pos);
+            };
+            return ast_.Execute(interpret_function, MakeRangeInterpreter(sheet), cell);
+        }
+
+        void EvaluateBatch(const SheetInterface& sheet, const std::vector<Position>& cells,
+                           std::vector<Value>& values) const override {
+            InterpretFunc interpret_function = [&sheet](Position pos) {
+                return InterpretCell(sheet, pos);
+            };
+            ast_.ExecuteBatch(interpret_function, MakeRangeInterpreter(sheet), cells, values);
+        }
+
+        std::string GetExpression(Position cell) const override {
+            std::ostringstream out;
+            ast_.PrintFormula(out, cell);
+            return out.str();
+        }
+
+        std::vector<Position> GetReferencedCells(Position cell) const override {
+            std::vector<Position> cells;
+            cells.reserve(offsets_.cells.size());
+            for (Position offset : offsets_.cells) {
+                cells.push_back({offset.row + cell.row, offset.col + cell.col});
+            }
+            return cells;
+        }
+
+        //Shifting keeps the ascending order of the cells and the ranges
+        FormulaReferences GetReferences(Position cell) const override {
+            FormulaReferences references;
+            references.cells.reserve(offsets_.cells.size());
+            for (Position offset : offsets_.cells) {
+                references.cells.push_back({offset.row + cell.row, offset.col + cell.col});
+            }
+            references.ranges.reserve(offsets_.ranges.size());
+            for (CellRange offset : offsets_.ranges) {
+                references.ranges.push_back(ShiftRange(offset, cell));
+            }
+            return references;
+        }
+
+        size_t GetAllocatedBytes() const override {
+            return sizeof(*this) + ast_.GetAllocatedBytes() + offsets_.cells.capacity() * sizeof(Position)
+                   + offsets_.ranges.capacity() * sizeof(CellRange);
+        }
+
+    private:
+        FormulaAST ast_;
+        FormulaReferences offsets_;
+    };
+
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
@@ -80,4 +181,99 @@ std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     } catch (...) {
         throw FormulaException("Parsing error");
     }
+}
+
+namespace {
+    std::shared_ptr<const SharedFormula> ParseSharedFormulaUncached(std::string_view expression,
+                                                                   Position cell) {
+        try {
+            return std::make_shared<RelativeFormula>(expression, cell);
+        } catch (...) {
+            throw FormulaException("Parsing error");
+        }
+    }
+}  // namespace
+
+FormulaCache& FormulaCache::Instance() {
+    static FormulaCache cache;
+    return cache;
+}
+
+std::shared_ptr<const SharedFormula> FormulaCache::Get(std::string_view expression, Position cell,
+                                                       bool* parsed) {
+    auto key = RelativeFormulaKey(expression, cell);
+    if (!key) {
+        //The text cannot be tokenized, parsing reports the error
+        return ParseSharedFormulaUncached(expression, cell);
+    }
+    {
+        std::lock_guard guard(mutex_);
+        if (auto formula = FindLocked(*key)) {
+            ++hits_;
+            return formula;
+        }
+        ++misses_;
+    }
+
+    //Parsing is done without the lock, so other threads are not blocked
+    auto formula = ParseSharedFormulaUncached(expression, cell);
+    if (parsed) {
+        *parsed = true;
+    }
+
+    std::lock_guard guard(mutex_);
+    if (capacity_ == 0) {
+        return formula;
+    }
+    if (auto same_formula = FindLocked(*key)) {
+        return same_formula;
+    }
+    InsertLocked(std::move(*key), formula);
+    return formula;
+}
+
+void FormulaCache::SetCapacity(size_t capacity) {
+    std::lock_guard guard(mutex_);
+    capacity_ = capacity;
+    EvictLocked();
+}
+
+FormulaCache::Stats FormulaCache::GetStats() const {
+    std::lock_guard guard(mutex_);
+    return {hits_, misses_, entries_.size(), capacity_};
+}
+
+void FormulaCache::Clear() {
+    std::lock_guard guard(mutex_);
+    index_.clear();
+    entries_.clear();
+    hits_ = 0;
+    misses_ = 0;
+}
+
+std::shared_ptr<const SharedFormula> FormulaCache::FindLocked(std::string_view key) {
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+        return nullptr;
+    }
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->second;
+}
+
+void FormulaCache::InsertLocked(std::string key, std::shared_ptr<const SharedFormula> formula) {
+    entries_.emplace_front(std::move(key), std::move(formula));
+    index_.emplace(entries_.front().first, entries_.begin());
+    EvictLocked();
+}
+
+void FormulaCache::EvictLocked() {
+    while (entries_.size() > capacity_) {
+        index_.erase(entries_.back().first);
+        entries_.pop_back();
+    }
+}
+
+std::shared_ptr<const SharedFormula> ParseSharedFormula(std::string_view expression, Position cell,
+                                                        bool* parsed) {
+    return FormulaCache::Instance().Get(expression, cell, parsed);
 }
\ No newline at end of file
@@ -2,16 +2,33 @@
 
 #include "common.h"
 
+#include <cstddef>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
+// The references of a formula as the sheet keeps them: the cells referenced
+// one by one and the ranges, which are not expanded into cells.
+// Both lists are sorted and do not contain duplicates.
+struct FormulaReferences {
+    std::vector<Position> cells;
+    std::vector<CellRange> ranges;
+};
+
 // A formula that allows calculating and updating an arithmetic expression.
 // Supported Features:
 // * Simple binary operations and numbers, brackets: 1+2*3, 2.5*(2+3.5/7)
 // * Cell values as variables: A1+B2*C3
+// * Aggregate functions of numbers and ranges of cells: SUM(A1:A100), AVERAGE(A1:B2,C3*2),
+//   MIN, MAX and COUNT (the number of numbers)
 // Cells, contained in the formula, can be both formulas and text. If cell value is text,
 // but the text can be interpreted as a number, then it will be interpreted as a number.
 // An empty cell or a cell with empty text is interpreted as the number zero.
+// Inside a range the empty cells and the text cells that are not numbers are skipped.
 class FormulaInterface {
 public:
     using Value = std::variant<double, FormulaError>;
@@ -32,9 +49,100 @@ public:
 
     // Returns a list of cells, which are directly involved in the formula calculation
     // The list is sorted in ascending order and does not contain duplicate cells.
+    // The ranges are not expanded into their cells, a range may cover the whole
+    // sheet; they are returned by GetReferences().
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Returns the cells referenced one by one and the ranges
+    virtual FormulaReferences GetReferences() const = 0;
 };
 
 // Parses the transmitted expression and returns the formula object.
 // Throws a FormulaException if the formula is syntactically incorrect.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+
+// A formula whose cell references are stored relative to the cell it is written in.
+// Formulas filled down or right ("=A1*B1" in C1, "=A2*B2" in C2, ...) are the same
+// relative formula, so a whole run of such cells shares one parsed AST and
+// every cell keeps only its own position.
+// The methods take the position of the cell the formula is used in
+// and have the same meaning as the FormulaInterface methods.
+class SharedFormula {
+public:
+    using Value = FormulaInterface::Value;
+
+    virtual ~SharedFormula() = default;
+
+    virtual Value Evaluate(const SheetInterface& sheet, Position cell) const = 0;
+
+    // Evaluates the formula for a whole run of cells at once,
+    // values[i] is the value of the formula in cells[i]
+    virtual void EvaluateBatch(const SheetInterface& sheet, const std::vector<Position>& cells,
+                               std::vector<Value>& values) const = 0;
+
+    virtual std::string GetExpression(Position cell) const = 0;
+
+    virtual std::vector<Position> GetReferencedCells(Position cell) const = 0;
+
+    virtual FormulaReferences GetReferences(Position cell) const = 0;
+
+    // Bytes of the formula object and everything it allocated
+    virtual size_t GetAllocatedBytes() const = 0;
+};
+
+// Process-wide bounded cache of parsed formulas.
+// Formulas are found by their relative key (see RelativeFormulaKey()), which
+// is built from the tokens of the text without parsing it. So a formula text
+// repeated in many cells, written with other spacing or filled down a column
+// is parsed only once and all the cells share one immutable SharedFormula.
+// When the cache is full, the least recently used entry is evicted.
+class FormulaCache {
+public:
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t size = 0;
+        size_t capacity = 0;
+    };
+
+    static constexpr size_t DEFAULT_CAPACITY = 1 << 16;
+
+    static FormulaCache& Instance();
+
+    // Returns the cached formula or parses and caches it, *parsed is set to
+    // true when the expression had to be parsed.
+    // Throws a FormulaException if the formula is syntactically incorrect.
+    std::shared_ptr<const SharedFormula> Get(std::string_view expression, Position cell,
+                                             bool* parsed = nullptr);
+
+    // Sets the maximum number of cached entries, zero disables the cache
+    void SetCapacity(size_t capacity);
+
+    Stats GetStats() const;
+
+    // Drops all entries and resets the counters
+    void Clear();
+
+private:
+    using Entry = std::pair<std::string, std::shared_ptr<const SharedFormula>>;
+
+    std::shared_ptr<const SharedFormula> FindLocked(std::string_view key);
+    void InsertLocked(std::string key, std::shared_ptr<const SharedFormula> formula);
+    void EvictLocked();
+
+    mutable std::mutex mutex_;
+    // most recently used entries are at the front
+    std::list<Entry> entries_;
+    // keys point to the strings stored in entries_
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+    size_t capacity_ = DEFAULT_CAPACITY;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+};
+
+// Parses the expression of the formula written in the cell or takes the same
+// relative formula from the process-wide FormulaCache.
+// Throws a FormulaException if the formula is syntactically incorrect.
+std::shared_ptr<const SharedFormula> ParseSharedFormula(std::string_view expression, Position cell,
+                                                        bool* parsed = nullptr);
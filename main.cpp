@@ -1,6 +1,12 @@
+#include <cmath>
 #include <limits>
+#include <thread>
 #include "common.h"
 #include "formula.h"
+#include "FormulaAST.h"
+#include "object_pool.h"
+#include "profiler.h"
+#include "sheet.h"
 #include "test_runner_p.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
@@ -131,6 +137,36 @@ void TestClearCell() {
     sheet->ClearCell("J10"_pos);
 }
 
+void TestCellsAcrossTiles() {
+    auto sheet = CreateSheet();
+    const Position corner{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+
+    sheet->SetCell("BL64"_pos, "left");
+    sheet->SetCell("BM65"_pos, "right");
+    sheet->SetCell(corner, "corner");
+    ASSERT_EQUAL(sheet->GetCell("BL64"_pos)->GetText(), "left");
+    ASSERT_EQUAL(sheet->GetCell("BM65"_pos)->GetText(), "right");
+    ASSERT_EQUAL(sheet->GetCell(corner)->GetText(), "corner");
+    ASSERT(sheet->GetCell("BM64"_pos) == nullptr);
+    ASSERT(sheet->GetCell("BL65"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+
+    sheet->ClearCell(corner);
+    ASSERT(sheet->GetCell(corner) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{65, 65}));
+
+    sheet->ClearCell("BM65"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{64, 64}));
+    std::string expected;
+    for (int row = 0; row < 63; ++row) {
+        expected += std::string(63, '\t') + '\n';
+    }
+    expected += std::string(63, '\t') + "left\n";
+    std::ostringstream texts;
+    sheet->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), expected);
+}
+
 void TestFormulaArithmetic() {
     auto sheet = CreateSheet();
     auto evaluate = [&](std::string expr) {
@@ -146,6 +182,23 @@ void TestFormulaArithmetic() {
     ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
 }
 
+void TestFormulaDeepExpression() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+
+    // right-nested operations keep every operand on the evaluation stack
+    std::string expression;
+    for (int i = 0; i < 100; ++i) {
+        expression += "A1-(";
+    }
+    expression += "-A1" + std::string(100, ')');
+
+    auto formula = ParseFormula(expression);
+    ASSERT_EQUAL(std::get<double>(formula->Evaluate(*sheet)), -2);
+    ASSERT_EQUAL(std::get<FormulaError>(ParseFormula("1/(A1-2)")->Evaluate(*sheet)),
+                 FormulaError(FormulaError::Category::Div0));
+}
+
 void TestFormulaReferences() {
     auto sheet = CreateSheet();
     auto evaluate = [&](std::string expr) {
@@ -201,6 +254,20 @@ void TestErrorValue() {
     sheet->SetCell("E2"_pos, "3D");
     ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
                  CellInterface::Value(FormulaError::Category::Value));
+
+    // the texts std::stod reads as a whole are numbers, the ones with
+    // something after the number are not
+    for (const auto& [text, number] : std::vector<std::pair<std::string, double>>{
+             {"+3", 3.0}, {" 3", 3.0}, {"\t-2.5e1", -25.0}, {"0x1A", 26.0}, {".5", 0.5}}) {
+        sheet->SetCell("E2"_pos, text);
+        ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(), CellInterface::Value(number));
+        ASSERT_EQUAL(std::get<std::string>(sheet->GetCell("E2"_pos)->GetValue()), text);
+    }
+    for (const std::string text : {"3 ", "3,5", "1e400", "0x", "+", " "}) {
+        sheet->SetCell("E2"_pos, text);
+        ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Value));
+    }
 }
 
 void TestErrorDiv0() {
@@ -251,6 +318,55 @@ void TestEmptyCellTreatedAsZero() {
     ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
 }
 
+void TestNumericValue() {
+    using NumericValue = CellInterface::NumericValue;
+    using NoNumber = CellInterface::NoNumber;
+    auto sheet = CreateSheet();
+    auto numeric = [&sheet](std::string_view pos) {
+        return sheet->GetCell(Position::FromString(pos))->GetNumericValue();
+    };
+    sheet->SetCell("A1"_pos, "35");
+    sheet->SetCell("A2"_pos, "'35");
+    sheet->SetCell("A3"_pos, "3.5e1x");
+    sheet->SetCell("A4"_pos, "=A1/2");
+    sheet->SetCell("A5"_pos, "=A1/0");
+    sheet->SetCell("B1"_pos, "=A6");
+
+    ASSERT(numeric("A1") == NumericValue(35.0));
+    ASSERT(numeric("A2") == NumericValue(NoNumber::TEXT));
+    ASSERT(numeric("A3") == NumericValue(NoNumber::TEXT));
+    ASSERT(numeric("A4") == NumericValue(17.5));
+    ASSERT(numeric("A5") == NumericValue(FormulaError::Category::Div0));
+    ASSERT(numeric("A6") == NumericValue(NoNumber::EMPTY));
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value("35"));
+
+    sheet->SetCell("A1"_pos, "text");
+    ASSERT(numeric("A1") == NumericValue(NoNumber::TEXT));
+    ASSERT_EQUAL(sheet->GetCell("A4"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+}
+
+void TestValueView() {
+    using ValueView = CellInterface::ValueView;
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "text");
+    sheet->SetCell("A2"_pos, "'=text");
+    sheet->SetCell("A3"_pos, "=1+2");
+    sheet->SetCell("A4"_pos, "=A1");
+    sheet->SetCell("A5"_pos, "=A6");
+
+    ASSERT(sheet->GetCell("A1"_pos)->GetValueView() == ValueView(std::string_view("text")));
+    ASSERT(sheet->GetCell("A2"_pos)->GetValueView() == ValueView(std::string_view("=text")));
+    ASSERT(sheet->GetCell("A3"_pos)->GetValueView() == ValueView(3.0));
+    ASSERT(sheet->GetCell("A4"_pos)->GetValueView() == ValueView(FormulaError::Category::Value));
+    ASSERT(sheet->GetCell("A6"_pos)->GetValueView() == ValueView(std::string_view()));
+    // the text is viewed where the cell keeps it
+    ASSERT(std::get<std::string_view>(sheet->GetCell("A1"_pos)->GetValueView()).data()
+           == std::get<std::string_view>(sheet->GetCell("A1"_pos)->GetValueView()).data());
+
+    sheet->SetCell("A6"_pos, "4");
+    ASSERT(sheet->GetCell("A5"_pos)->GetValueView() == ValueView(4.0));
+}
+
 void TestFormulaInvalidPosition() {
     auto sheet = CreateSheet();
     auto try_formula = [&](const std::string& formula) {
@@ -287,6 +403,50 @@ void TestPrint() {
     ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
 }
 
+void TestPrintSparseSheet() {
+    auto sheet = CreateSheet();
+    const std::vector<std::pair<std::string, double>> formulas = {
+        {"=1/3", 1.0 / 3}, {"=1e20*3", 1e20 * 3}, {"=123456789", 123456789},
+        {"=0.1+0.2", 0.1 + 0.2}, {"=-2.5", -2.5}, {"=1e-7", 1e-7}};
+
+    std::ostringstream expected;
+    for (size_t i = 0; i < formulas.size(); ++i) {
+        sheet->SetCell(Position{static_cast<int>(i), 0}, formulas[i].first);
+        expected << formulas[i].second << "\t\t\n";
+    }
+    sheet->SetCell("C9"_pos, "'far");
+    expected << "\t\t\n\t\t\n\t\tfar\n";
+
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT_EQUAL(values.str(), expected.str());
+
+    std::ostringstream texts;
+    sheet->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "=1/3\t\t\n=1e+20*3\t\t\n=1.23457e+08\t\t\n=0.1+0.2\t\t\n"
+                              "=-2.5\t\t\n=1e-07\t\t\n\t\t\n\t\t\n\t\t'far\n");
+}
+
+void TestPrintableSizeIsMaintained() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("C3"_pos, "edge");
+    sheet->SetCell("B5"_pos, "bottom");
+    sheet->SetCell("A1"_pos, "=Z100+E2");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 3}));
+
+    sheet->SetCell("E2"_pos, "");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 3}));
+
+    sheet->ClearCell("B5"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{3, 3}));
+
+    sheet->SetCell("C3"_pos, "");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+}
+
 void TestCellReferences() {
     auto sheet = CreateSheet();
     sheet->SetCell("A1"_pos, "1");
@@ -311,6 +471,418 @@ void TestCellReferences() {
     ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"C3"_pos});
 }
 
+void TestParserMatchesAntlr() {
+    // describes the parsed AST or the fact that parsing failed
+    auto describe = [](auto parse) -> std::string {
+        try {
+            FormulaAST ast = parse();
+            std::ostringstream out;
+            ast.Print(out);
+            out << " | ";
+            ast.PrintFormula(out);
+            out << " | ";
+            ast.PrintCells(out);
+            return out.str();
+        } catch (...) {
+            return "error";
+        }
+    };
+
+    const std::vector<std::string> expressions = {
+        "1", "  42  ", "1+2*3", "(1+2)*3", "-1+2", "-1*2", "--1", "+-+1", "2*-3", "2--3",
+        "1-2-3", "8/4/2", "1/(2/3)", "1-(2+3)", "-(1+2)", "+(1-2)/3", "A1+B2*C3", "(A1)",
+        "A1+A2+A1", "XFD16384", "1.5e3", ".5", "1E5", "1e+2", "2.5E-3", "1e-400", "1e400",
+        "1\t+\n2\r", "3X", "A2B", "A0++", "((1)", "2+4-", "", "()", "1.", "1e", "1E",
+        "x1", "1 2", "ZZZZ1", "A123456", "A0", "*1", "1+", "(1))", "1..2", "$A$1", "a1",
+        "SUM(A1:B2)", "SUM(B2:A1)+1", "MAX(A1,2*B3,C1:C9)", "-MIN(A1:A3,MAX(B1:B2))",
+        "COUNT(A1 , 1)", "AVERAGE((A1))", "SUM()", "SUM(A1:)", "SUM(:A1)", "A1:B2", "SUM((A1:B2))",
+        "SUM(A1:B2*2)", "SUM(1,)", "SUM 1", "SUMA1", "MAXX(1)", "sum(1)", "SUM(A0:B2)"};
+
+    for (const auto& expression : expressions) {
+        std::string expected = describe([&] {
+            std::istringstream in(expression);
+            return ParseFormulaAST(in);
+        });
+        std::string actual = describe([&] {
+            return ParseFormulaAST(expression);
+        });
+        ASSERT_EQUAL(actual, expected);
+    }
+}
+
+void TestFormulaCache() {
+    FormulaCache& cache = FormulaCache::Instance();
+    cache.Clear();
+    cache.SetCapacity(3);
+
+    auto first = ParseSharedFormula("A1*B1", "C1"_pos);
+    auto second = ParseSharedFormula("A1*B1", "C1"_pos);
+    auto spaced = ParseSharedFormula(" A1 * B1 ", "C1"_pos);
+    ASSERT(first == second);
+    ASSERT(first == spaced);
+    ASSERT_EQUAL(cache.GetStats().hits, 2u);
+    ASSERT_EQUAL(cache.GetStats().misses, 1u);
+    ASSERT_EQUAL(cache.GetStats().size, 1u);
+
+    try {
+        ParseSharedFormula("A1*", "C1"_pos);
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    ASSERT_EQUAL(cache.GetStats().size, 1u);
+
+    // the least recently used "A1*B1" is evicted first
+    ParseSharedFormula("1+2", "C1"_pos);
+    ParseSharedFormula("3", "C1"_pos);
+    ParseSharedFormula("12", "C1"_pos);
+    ASSERT_EQUAL(cache.GetStats().size, 3u);
+    ASSERT(ParseSharedFormula("1 + 2", "C1"_pos) == ParseSharedFormula("1+2", "C1"_pos));
+    ASSERT(ParseSharedFormula("A1*B1", "C1"_pos) != first);
+
+    cache.SetCapacity(0);
+    ASSERT_EQUAL(cache.GetStats().size, 0u);
+    ASSERT(ParseSharedFormula("A1*B1", "C1"_pos) != ParseSharedFormula("A1*B1", "C1"_pos));
+
+    cache.SetCapacity(FormulaCache::DEFAULT_CAPACITY);
+    cache.Clear();
+}
+
+void TestSharedFormulaFillDown() {
+    auto sheet = CreateSheet();
+    constexpr int ROWS = 100;
+    for (int row = 0; row < ROWS; ++row) {
+        const std::string name = std::to_string(row + 1);
+        sheet->SetCell(Position{row, 0}, std::to_string(row));
+        sheet->SetCell(Position{row, 1}, row == 50 ? "text" : "2");
+        // the first row has no row above to refer to
+        sheet->SetCell(Position{row, 2}, row == 0 ? "=A1*B1"
+                                                  : "=A" + name + "*B" + name + "+C" + std::to_string(row));
+    }
+
+    auto template_formula = ParseSharedFormula("A2*B2+C1", "C2"_pos);
+    ASSERT(template_formula == ParseSharedFormula("A70*B70+C69", "C70"_pos));
+    ASSERT(template_formula != ParseSharedFormula("A70*B70+C69", "C71"_pos));
+
+    ASSERT_EQUAL(sheet->GetCell("C70"_pos)->GetText(), "=A70*B70+C69");
+    ASSERT_EQUAL(sheet->GetCell("C70"_pos)->GetReferencedCells(),
+                 (std::vector{"C69"_pos, "A70"_pos, "B70"_pos}));
+    ASSERT_EQUAL(sheet->GetCell("C50"_pos)->GetValue(), CellInterface::Value(49.0 * 50.0));
+    ASSERT_EQUAL(sheet->GetCell("C51"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+
+    std::vector<Position> cells;
+    for (int row = 1; row < ROWS; ++row) {
+        cells.push_back(Position{row, 2});
+    }
+    std::vector<FormulaInterface::Value> values;
+    template_formula->EvaluateBatch(*sheet, cells, values);
+    ASSERT_EQUAL(values.size(), cells.size());
+    for (size_t i = 0; i < cells.size(); ++i) {
+        auto expected = template_formula->Evaluate(*sheet, cells[i]);
+        ASSERT(values[i] == expected);
+    }
+}
+
+void TestCacheInvalidation() {
+    auto sheet = CreateSheet();
+    // every level is a diamond: B and C both read A of the level below,
+    // a walk without a visited set would reset the top 2^LEVELS times
+    constexpr int LEVELS = 40;
+    sheet->SetCell("A1"_pos, "1");
+    for (int row = 1; row < LEVELS; ++row) {
+        const std::string below = std::to_string(row);
+        sheet->SetCell(Position{row, 1}, "=A" + below);
+        sheet->SetCell(Position{row, 2}, "=A" + below);
+        sheet->SetCell(Position{row, 0}, "=B" + std::to_string(row + 1) + "+C" + std::to_string(row + 1));
+    }
+    const Position top{LEVELS - 1, 0};
+    ASSERT_EQUAL(sheet->GetCell(top)->GetValue(), CellInterface::Value(std::pow(2.0, LEVELS - 1)));
+
+    sheet->SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(sheet->GetCell(top)->GetValue(), CellInterface::Value(3 * std::pow(2.0, LEVELS - 1)));
+
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetCell(top)->GetValue(), CellInterface::Value(0.0));
+
+    // a long chain is reset without recursion; it is evaluated bottom-up,
+    // so every evaluation reads an already cached cell
+    constexpr int CHAIN = 5000;
+    sheet->SetCell("D1"_pos, "1");
+    for (int row = 1; row < CHAIN; ++row) {
+        sheet->SetCell(Position{row, 3}, "=D" + std::to_string(row) + "+1");
+    }
+    for (int pass = 1; pass <= 2; ++pass) {
+        for (int row = 0; row < CHAIN; ++row) {
+            sheet->GetCell(Position{row, 3})->GetValue();
+        }
+        ASSERT_EQUAL(sheet->GetCell(Position{CHAIN - 1, 3})->GetValue(),
+                     CellInterface::Value(static_cast<double>(CHAIN * pass)));
+        sheet->SetCell("D1"_pos, std::to_string(CHAIN + 1));
+    }
+}
+
+void TestRecalculate() {
+    // the same edits on two sheets, one calculated by Recalculate(),
+    // the other on demand
+    auto parallel = CreateSheet();
+    auto lazy = CreateSheet();
+    auto set_both = [&](Position pos, const std::string& text) {
+        parallel->SetCell(pos, text);
+        lazy->SetCell(pos, text);
+    };
+    constexpr int ROWS = 2000;
+    set_both("A1"_pos, "2");
+    for (int row = 1; row < ROWS; ++row) {
+        const std::string above = std::to_string(row);
+        set_both(Position{row, 0}, "=A" + above + "+1");
+        set_both(Position{row, 1}, "=A1*A" + above);
+        set_both(Position{row, 2}, row % 100 == 0 ? "=B" + above + "/0" : "=B" + above + "-C" + above);
+    }
+    auto check = [&] {
+        parallel->Recalculate(4);
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 0; col < 3; ++col) {
+                const Position pos{row, col};
+                ASSERT(parallel->GetCell(pos)->GetValue() == lazy->GetCell(pos)->GetValue());
+            }
+        }
+    };
+    check();
+    set_both("A1"_pos, "3");
+    set_both("C500"_pos, "text");
+    check();
+    parallel->ClearCell("A1"_pos);
+    lazy->ClearCell("A1"_pos);
+    check();
+    // nothing changed since the last calculation
+    parallel->Recalculate(1);
+    check();
+}
+
+void TestRecalculateRuns() {
+    // the formulas filled down a column are calculated in batches
+    Sheet sheet;
+    constexpr int ROWS = 1000;
+    for (int row = 0; row < ROWS; ++row) {
+        const std::string name = std::to_string(row + 1);
+        sheet.SetCell(Position{row, 0}, std::to_string(row));
+        sheet.SetCell(Position{row, 1}, row % 97 == 0 ? "text" : "0.5");
+        sheet.SetCell(Position{row, 2}, "=A" + name + "/B" + name + "-SUM(A" + name + ":B" + name + ")");
+    }
+    // a cell between the runs with another formula
+    sheet.SetCell("C500"_pos, "=1/0");
+    sheet.Recalculate(3);
+
+    const SheetStats stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.cache_misses, static_cast<uint64_t>(ROWS));
+    for (int row = 0; row < ROWS; ++row) {
+        const Position pos{row, 2};
+        const Cell* cell = dynamic_cast<const Cell*>(sheet.GetCell(pos));
+        ASSERT(cell->HasCachedValue());
+        const auto formula = cell->GetImpl()->GetSharedFormula();
+        auto expected = formula->Evaluate(sheet, pos);
+        ASSERT(std::visit([](const auto& value) {
+            return CellInterface::Value(value);
+        }, expected) == cell->GetValue());
+    }
+    ASSERT_EQUAL(sheet.GetStats().cache_misses, static_cast<uint64_t>(ROWS));
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), CellInterface::Value(2.0 / 0.5 - 2.5));
+    ASSERT_EQUAL(sheet.GetCell("C98"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Div0));
+}
+
+void TestConcurrentReaders() {
+    auto sheet = CreateSheet();
+    constexpr int ROWS = 500;
+    sheet->SetCell("A1"_pos, "=1");
+    for (int row = 1; row < ROWS; ++row) {
+        const std::string above = std::to_string(row);
+        sheet->SetCell(Position{row, 0}, "=A" + above + "+1");
+        sheet->SetCell(Position{row, 1}, "=A" + std::to_string(row + 1) + "*B" + above);
+    }
+    sheet->SetCell("B1"_pos, "'text");
+
+    // the threads calculate the uncached cells in different orders
+    std::vector<std::thread> readers;
+    std::vector<int> mismatches(4);
+    for (int reader = 0; reader < 4; ++reader) {
+        readers.emplace_back([&, reader] {
+            for (int i = 0; i < ROWS; ++i) {
+                const int row = reader % 2 ? ROWS - 1 - i : i;
+                const auto value = sheet->GetCell(Position{row, 0})->GetValue();
+                mismatches[reader] += !(value == CellInterface::Value(row + 1.0));
+                sheet->GetCell(Position{row, 1})->GetValue();
+            }
+        });
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    ASSERT_EQUAL(mismatches, std::vector<int>(4));
+    ASSERT_EQUAL(sheet->GetCell("B500"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+}
+
+void TestSnapshot() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("B1"_pos, "=A1*10");
+    sheet->SetCell("C2"_pos, "=B1+Z100");
+    auto snapshot = sheet->Snapshot();
+
+    sheet->SetCell("A1"_pos, "3");
+    sheet->ClearCell("C2"_pos);
+    sheet->SetCell("D4"_pos, "new");
+
+    ASSERT_EQUAL(snapshot->GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT_EQUAL(snapshot->GetCell("C2"_pos)->GetText(), "=B1+Z100");
+    ASSERT_EQUAL(snapshot->GetCell("C2"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT(snapshot->GetCell("D4"_pos) == nullptr);
+    ASSERT_EQUAL(snapshot->GetPrintableSize(), (Size{2, 3}));
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(30.0));
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{4, 4}));
+
+    std::ostringstream texts;
+    snapshot->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "2\t=A1*10\t\n\t\t=B1+Z100\n");
+    std::ostringstream values;
+    snapshot->PrintValues(values);
+    ASSERT_EQUAL(values.str(), "2\t20\t\n\t\t20\n");
+
+    // readers print an old snapshot while the writer keeps changing the sheet
+    constexpr int ROWS = 300;
+    for (int row = 0; row < ROWS; ++row) {
+        sheet->SetCell(Position{row, 5}, row == 0 ? "1" : "=F" + std::to_string(row) + "+1");
+    }
+    auto old_snapshot = sheet->Snapshot();
+    std::ostringstream expected;
+    old_snapshot->PrintValues(expected);
+    // the same state with nothing calculated yet
+    auto fresh_snapshot = sheet->Snapshot();
+
+    std::vector<std::thread> readers;
+    std::vector<int> mismatches(3);
+    for (int reader = 0; reader < 3; ++reader) {
+        readers.emplace_back([&, reader] {
+            for (int i = 0; i < 20; ++i) {
+                std::ostringstream printed;
+                (reader == 0 ? old_snapshot : fresh_snapshot)->PrintValues(printed);
+                mismatches[reader] += printed.str() != expected.str();
+            }
+        });
+    }
+    for (int row = 0; row < ROWS; ++row) {
+        sheet->SetCell(Position{row, 5}, row == 0 ? "100" : "=F" + std::to_string(row) + "*2");
+        sheet->SetCell(Position{row, 6}, "x");
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    ASSERT_EQUAL(mismatches, std::vector<int>(3));
+    ASSERT_EQUAL(old_snapshot->GetCell("F300"_pos)->GetValue(), CellInterface::Value(300.0));
+}
+
+void TestSetCells() {
+    auto texts_of = [](const SheetInterface& sheet) {
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        return texts.str();
+    };
+    auto values_of = [](const SheetInterface& sheet) {
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        return values.str();
+    };
+
+    // a batch gives the same sheet as the same cells set one by one,
+    // the references inside the batch may point forward
+    std::vector<std::pair<Position, std::string>> batch;
+    auto sequential = CreateSheet();
+    constexpr int ROWS = 300;
+    for (int row = ROWS - 1; row > 0; --row) {
+        const std::string above = std::to_string(row);
+        batch.emplace_back(Position{row, 0}, "=A" + above + "+1");
+        batch.emplace_back(Position{row, 1}, "=A" + above + "*C" + std::to_string(row + 1));
+    }
+    batch.emplace_back("A1"_pos, "1");
+    for (int row = 0; row < ROWS; ++row) {
+        for (int col = 0; col < 2; ++col) {
+            for (const auto& [pos, text] : batch) {
+                if (pos == Position{row, col}) {
+                    sequential->SetCell(pos, text);
+                }
+            }
+        }
+    }
+    auto sheet = CreateSheet();
+    sheet->SetCells(batch, 2);
+    ASSERT_EQUAL(texts_of(*sheet), texts_of(*sequential));
+    ASSERT_EQUAL(values_of(*sheet), values_of(*sequential));
+    ASSERT_EQUAL(sheet->GetPrintableSize(), sequential->GetPrintableSize());
+
+    // the cached values depending on the batch are reset
+    ASSERT_EQUAL(sheet->GetCell("A300"_pos)->GetValue(), CellInterface::Value(300.0));
+    sheet->SetCells({{"A1"_pos, "5"}, {"C300"_pos, "2"}, {"A1"_pos, "11"}});
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "11");
+    ASSERT_EQUAL(sheet->GetCell("A300"_pos)->GetValue(), CellInterface::Value(310.0));
+    ASSERT_EQUAL(sheet->GetCell("B300"_pos)->GetValue(), CellInterface::Value(618.0));
+
+    // the batch as a whole has no cycles, though setting B1 first would make one
+    sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B1");
+    sheet->SetCells({{"B1"_pos, "=A1+1"}, {"A1"_pos, "2"}});
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    // a rejected batch does not change the sheet
+    const std::string texts = texts_of(*sheet);
+    const std::string values = values_of(*sheet);
+    try {
+        sheet->SetCells({{"C1"_pos, "=B1"}, {"A1"_pos, "=C1"}, {"D1"_pos, "=E1"}});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        sheet->SetCells({{"C1"_pos, "=B1"}, {"A1"_pos, "=1+"}});
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    try {
+        sheet->SetCells({{"C1"_pos, "=B1"}, {Position{-1, 0}, "1"}});
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+    ASSERT_EQUAL(texts_of(*sheet), texts);
+    ASSERT_EQUAL(values_of(*sheet), values);
+    ASSERT(sheet->GetCell("C1"_pos) == nullptr);
+    ASSERT(sheet->GetCell("E1"_pos) == nullptr);
+    sheet->SetCell("B1"_pos, "=A1*10");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+    try {
+        sheet->SetCell("A1"_pos, "=B1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    // every edit of a batch is linked into the graph once, as by SetCell()
+    Sheet one_by_one;
+    Sheet batched;
+    const std::vector<std::pair<Position, std::string>> edits = {
+        {"A1"_pos, "1"}, {"A2"_pos, "=A1+C1"}, {"A3"_pos, "=SUM(A1:A2)+A2+C2"}, {"B1"_pos, "=SUM(A1:A16384)"}};
+    for (const auto& [pos, text] : edits) {
+        one_by_one.SetCell(pos, text);
+    }
+    batched.SetCells(edits);
+    ASSERT_EQUAL(batched.GetStats().graph_bytes, one_by_one.GetStats().graph_bytes);
+    ASSERT_EQUAL(batched.GetStats().placeholders_created, 2u);
+    ASSERT_EQUAL(texts_of(batched), texts_of(one_by_one));
+    ASSERT_EQUAL(values_of(batched), values_of(one_by_one));
+    batched.SetCell("C1"_pos, "5");
+    ASSERT_EQUAL(batched.GetCell("A3"_pos)->GetValue(), CellInterface::Value(13.0));
+    ASSERT_EQUAL(batched.GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+}
+
 void TestFormulaIncorrect() {
     auto isIncorrect = [](std::string expression) {
         try {
@@ -328,6 +900,442 @@ void TestFormulaIncorrect() {
     ASSERT(isIncorrect("2+4-"));
 }
 
+void TestRangeFunctions() {
+    auto sheet = CreateSheet();
+    auto value = [&sheet](std::string_view pos) {
+        return sheet->GetCell(Position::FromString(pos))->GetValue();
+    };
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1+1");
+    sheet->SetCell("A3"_pos, "text");
+    sheet->SetCell("A5"_pos, "'5");
+    sheet->SetCell("B1"_pos, "4");
+    sheet->SetCell("C1"_pos, "=SUM(A1:B5)");
+    sheet->SetCell("C2"_pos, "=AVERAGE(B5:A1)");
+    sheet->SetCell("C3"_pos, "=MIN(A1:A5, 0.5)");
+    sheet->SetCell("C4"_pos, "=MAX(A1:B5)*2");
+    sheet->SetCell("C5"_pos, "=COUNT(A1:B5,A1,7)");
+    sheet->SetCell("C6"_pos, "=AVERAGE(D1:D5)");
+    sheet->SetCell("C7"_pos, "=MAX(D1:D5)-SUM(D1:D5)");
+
+    // the empty cells and the text cells are skipped
+    ASSERT_EQUAL(value("C1"), CellInterface::Value(7.0));
+    ASSERT_EQUAL(value("C2"), CellInterface::Value(7.0 / 3));
+    ASSERT_EQUAL(value("C3"), CellInterface::Value(0.5));
+    ASSERT_EQUAL(value("C4"), CellInterface::Value(8.0));
+    ASSERT_EQUAL(value("C5"), CellInterface::Value(5.0));
+    ASSERT_EQUAL(value("C6"), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(value("C7"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(sheet->GetCell("C2"_pos)->GetText(), "=AVERAGE(A1:B5)");
+    ASSERT_EQUAL(sheet->GetCell("C3"_pos)->GetText(), "=MIN(A1:A5,0.5)");
+    ASSERT(sheet->GetCell("C1"_pos)->GetReferencedCells().empty());
+    ASSERT_EQUAL(sheet->GetCell("C5"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+    ASSERT(sheet->GetCell("B5"_pos) == nullptr);
+
+    // the cells set inside a range after the formula reset its value
+    sheet->SetCell("B5"_pos, "10");
+    ASSERT_EQUAL(value("C1"), CellInterface::Value(17.0));
+    ASSERT_EQUAL(value("C5"), CellInterface::Value(6.0));
+    sheet->SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(value("C1"), CellInterface::Value(21.0));
+    sheet->ClearCell("B5"_pos);
+    ASSERT_EQUAL(value("C1"), CellInterface::Value(11.0));
+    sheet->SetCell("B4"_pos, "=1/0");
+    ASSERT_EQUAL(value("C1"), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(value("C5"), CellInterface::Value(FormulaError::Category::Div0));
+    sheet->ClearCell("B4"_pos);
+
+    // cycles through ranges, including cells that do not exist yet
+    for (const auto& [pos, text] : std::vector<std::pair<Position, std::string>>{
+             {"D1"_pos, "=SUM(C1:D1)"}, {"A4"_pos, "=C1"}, {"B2"_pos, "=C4+1"}, {"E1"_pos, "=SUM(D1:E9)"}}) {
+        try {
+            sheet->SetCell(pos, text);
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+    }
+    ASSERT(sheet->GetCell("A4"_pos) == nullptr);
+    ASSERT(sheet->GetCell("B2"_pos) == nullptr);
+    try {
+        sheet->SetCells({{"F1"_pos, "=SUM(F2:F3)"}, {"F3"_pos, "=F1"}});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(sheet->GetCell("F1"_pos) == nullptr);
+
+    // a range filled down is shared as one relative formula
+    sheet = CreateSheet();
+    constexpr int ROWS = 2000;
+    constexpr int WINDOW = 10;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < ROWS; ++row) {
+        cells.emplace_back(Position{row, 0}, std::to_string(row));
+        if (row >= WINDOW - 1) {
+            cells.emplace_back(Position{row, 1}, "=AVERAGE(A" + std::to_string(row - WINDOW + 2) + ":A"
+                                                     + std::to_string(row + 1) + ")");
+        }
+    }
+    cells.emplace_back("C1"_pos, "=SUM(B1:B" + std::to_string(ROWS) + ")+COUNT(B1:B" + std::to_string(ROWS) + ")");
+    sheet->SetCells(cells);
+    sheet->Recalculate(2);
+    double total = 0;
+    for (int row = WINDOW - 1; row < ROWS; ++row) {
+        const double average = row - (WINDOW - 1) / 2.0;
+        ASSERT_EQUAL(sheet->GetCell(Position{row, 1})->GetValue(), CellInterface::Value(average));
+        total += average;
+    }
+    ASSERT_EQUAL(value("C1"), CellInterface::Value(total + ROWS - WINDOW + 1));
+    sheet->SetCell("A1000"_pos, "1000000");
+    sheet->Recalculate(2);
+    ASSERT_EQUAL(value("B1000"), CellInterface::Value(999.0 - 4.5 + (1000000.0 - 999.0) / WINDOW));
+    ASSERT(std::get<double>(value("C1")) > total + 1000000.0 - 999.0);
+}
+
+void TestLargeRange() {
+    // a range over nearly the whole sheet reads only its stored cells
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("C3"_pos, "text");
+    sheet->SetCell("D4"_pos, "=A1*2");
+    sheet->SetCell("XFD16383"_pos, "4");
+    sheet->SetCell("A16384"_pos, "=SUM(A1:XFD16383)");
+    sheet->SetCell("B16384"_pos, "=COUNT(A1:XFD16383)");
+    ASSERT_EQUAL(sheet->GetCell("A16384"_pos)->GetValue(), CellInterface::Value(7.0));
+    ASSERT_EQUAL(sheet->GetCell("B16384"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    // the ranges are not expanded into the referenced cells
+    auto formula = ParseFormula("SUM(A1:XFD16384)+MAX(B2:C3,B3)*A1");
+    ASSERT_EQUAL(formula->GetReferencedCells(), (std::vector{"A1"_pos, "B3"_pos}));
+    const FormulaReferences references = formula->GetReferences();
+    ASSERT_EQUAL(references.cells, (std::vector{"A1"_pos, "B3"_pos}));
+    ASSERT_EQUAL(references.ranges.size(), 2u);
+    ASSERT(sheet->GetCell("A16384"_pos)->GetReferencedCells().empty());
+    const Cell* cell = dynamic_cast<const Cell*>(sheet->GetCell("A16384"_pos));
+    ASSERT_EQUAL(cell->GetReferences().ranges.size(), 1u);
+
+    std::vector<Position> visited;
+    sheet->ForEachCellInRange({"B2"_pos, "XFD16384"_pos}, [&visited](Position pos, const CellInterface&) {
+        visited.push_back(pos);
+    });
+    ASSERT_EQUAL(visited, (std::vector{"C3"_pos, "D4"_pos, "XFD16383"_pos, "B16384"_pos}));
+
+    auto snapshot = sheet->Snapshot();
+    sheet->SetCell("D4"_pos, "=1/0");
+    ASSERT_EQUAL(sheet->GetCell("A16384"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(snapshot->GetCell("A16384"_pos)->GetValue(), CellInterface::Value(7.0));
+    ASSERT_EQUAL(snapshot->GetCell("B16384"_pos)->GetValue(), CellInterface::Value(3.0));
+}
+
+void TestLargeRangeEdgesAreCheap() {
+    // the ranges of a whole column or of the whole sheet are not indexed
+    // tile by tile, so setting them costs the same as a small range
+    Sheet sheet;
+    sheet.SetCell("A2"_pos, "5");
+    sheet.SetCell("XFD16384"_pos, "21");
+    const size_t dependencies = sheet.MemoryUsage().dependencies;
+    const uint64_t graph_bytes = sheet.GetStats().graph_bytes;
+    constexpr int EDITS = 20;
+    for (int edit = 0; edit < EDITS; ++edit) {
+        sheet.SetCell("A1"_pos, edit % 2 ? "=SUM(A2:XFD16384)" : "=SUM(XFD16384:A2)+0");
+    }
+    ASSERT(sheet.MemoryUsage().dependencies - dependencies < 4096);
+    ASSERT(sheet.GetStats().graph_bytes - graph_bytes < EDITS * 256);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(26.0));
+
+    // the cells set later inside the ranges still reach their dependents
+    sheet.SetCell("B1"_pos, "=SUM(C1:C16384)");
+    sheet.SetCell("C1000"_pos, "=A2*2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(36.0));
+    sheet.SetCell("A2"_pos, "6");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(39.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(12.0));
+    try {
+        sheet.SetCell("C5"_pos, "=B1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    sheet.SetCell("A2"_pos, "7");
+    sheet.Recalculate(2);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(42.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(14.0));
+}
+
+void TestEvaluationProfiler() {
+    auto& profiler = EvaluationProfiler::Instance();
+    profiler.Reset();
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1+1");
+    sheet->SetCell("A3"_pos, "=A2*2");
+    sheet->SetCell("B1"_pos, "=A2+A3");
+    sheet->GetCell("B1"_pos)->GetValue();
+    sheet->GetCell("B1"_pos)->GetValue();
+
+    if (!EvaluationProfiler::ENABLED) {
+        ASSERT(profiler.GetProfiles().empty());
+        return;
+    }
+    auto profile = [&profiler](Position pos) {
+        for (const CellProfile& profile : profiler.GetProfiles()) {
+            if (profile.pos == pos) {
+                return profile;
+            }
+        }
+        return CellProfile{};
+    };
+    const CellProfile b1 = profile("B1"_pos);
+    ASSERT_EQUAL(b1.evaluations, 1u);
+    ASSERT_EQUAL(b1.cache_misses, 1u);
+    ASSERT_EQUAL(b1.cache_hits, 1u);
+    ASSERT_EQUAL(b1.instructions, 3u);
+    ASSERT_EQUAL(b1.max_depth, 0);
+    ASSERT(b1.inclusive_time >= b1.exclusive_time);
+    // A3 reads the value of A2 cached by B1
+    const CellProfile a2 = profile("A2"_pos);
+    ASSERT_EQUAL(a2.evaluations, 1u);
+    ASSERT_EQUAL(a2.cache_misses, 1u);
+    ASSERT_EQUAL(a2.cache_hits, 1u);
+    ASSERT_EQUAL(a2.max_depth, 1);
+    ASSERT_EQUAL(profiler.GetTopCells(10).size(), 3u);
+    ASSERT_EQUAL(profiler.GetTopCells(1).size(), 1u);
+
+    const auto path = profiler.GetCriticalPath();
+    ASSERT(!path.empty());
+    ASSERT_EQUAL(path.front().pos, "A2"_pos);
+    ASSERT_EQUAL(path.back().pos, "B1"_pos);
+
+    std::ostringstream report;
+    profiler.PrintReport(report, 2);
+    ASSERT(report.str().find("Critical path") != std::string::npos);
+    profiler.Reset();
+    ASSERT(profiler.GetProfiles().empty());
+}
+
+void TestProfilerReportKeepsStreamFormat() {
+    auto& profiler = EvaluationProfiler::Instance();
+    profiler.Reset();
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=1/3");
+    sheet->SetCell("B1"_pos, "=A1*3");
+    sheet->GetCell("B1"_pos)->GetValue();
+
+    // the values printed after the report are formatted as before it
+    std::ostringstream output;
+    output.fill('*');
+    profiler.PrintReport(output, 2);
+    ASSERT_EQUAL(output.fill(), '*');
+    ASSERT_EQUAL(output.precision(), 6);
+    ASSERT_EQUAL(output.flags(), std::ostringstream().flags());
+    output.str("");
+    sheet->PrintValues(output);
+    ASSERT_EQUAL(output.str(), "0.333333\t1\n");
+    profiler.Reset();
+}
+
+void TestSheetStats() {
+    FormulaCache::Instance().Clear();
+    Sheet sheet;
+    ASSERT_EQUAL(sheet.GetStats().formulas_parsed, 0u);
+
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+C1");
+    // the same relative formula is taken from the FormulaCache
+    sheet.SetCell("B2"_pos, "=A2+C2");
+    SheetStats stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.formulas_parsed, 1u);
+    ASSERT_EQUAL(stats.placeholders_created, 3u);
+    ASSERT(stats.cell_bytes >= 6 * sizeof(Cell));
+    ASSERT(stats.graph_bytes > 0);
+    ASSERT(stats.storage_bytes > 0);
+
+    // text cells are not cached, so only the formula reads are counted
+    sheet.GetCell("B1"_pos)->GetValue();
+    sheet.GetCell("B1"_pos)->GetValue();
+    sheet.GetCell("A1"_pos)->GetValue();
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.cache_misses, 1u);
+    ASSERT_EQUAL(stats.cache_hits, 1u);
+
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetStats().cells_invalidated, 1u);
+
+    sheet.SetCell("A3"_pos, "=A4");
+    sheet.SetCell("A4"_pos, "=A5");
+    ASSERT_EQUAL(sheet.GetStats().cycle_check_nodes, 0u);
+    try {
+        sheet.SetCell("A5"_pos, "=A3");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    stats = sheet.GetStats();
+    ASSERT(stats.cycle_check_nodes > 0);
+    // "=A5" in A4 is the relative formula of A3, the rejected one is parsed too
+    ASSERT_EQUAL(stats.formulas_parsed, 3u);
+
+    // the counters are cumulative, clearing the cells does not lower them
+    sheet.ClearCell("B1"_pos);
+    sheet.ClearCell("B2"_pos);
+    ASSERT(sheet.GetStats().storage_bytes == stats.storage_bytes);
+    ASSERT(sheet.GetStats().cell_bytes >= stats.cell_bytes);
+
+    // a cell rejected with its formula is not counted
+    const uint64_t cell_bytes = sheet.GetStats().cell_bytes;
+    try {
+        sheet.SetCell("H1"_pos, "=1+");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    ASSERT_EQUAL(sheet.GetStats().cell_bytes, cell_bytes);
+
+    // the reads counted on many threads at once are all summed
+    const SheetStats before = sheet.GetStats();
+    constexpr int THREADS = 8;
+    constexpr int READS = 1000;
+    std::vector<std::thread> readers;
+    for (int thread = 0; thread < THREADS; ++thread) {
+        readers.emplace_back([&sheet] {
+            for (int read = 0; read < READS; ++read) {
+                sheet.GetCell("A4"_pos)->GetValue();
+            }
+        });
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    const SheetStats after = sheet.GetStats();
+    ASSERT_EQUAL(after.cache_hits + after.cache_misses - before.cache_hits - before.cache_misses,
+                 static_cast<uint64_t>(THREADS * READS));
+}
+
+void TestSheetMemoryUsage() {
+    Sheet sheet;
+    const SheetMemoryUsage empty = sheet.MemoryUsage();
+    ASSERT_EQUAL(empty.cells, 0u);
+    ASSERT_EQUAL(empty.formulas, 0u);
+    ASSERT(empty.storage > 0);
+
+    sheet.SetCell("A1"_pos, "a text too long to be stored in the string object");
+    sheet.SetCell("A2"_pos, "12");
+    SheetMemoryUsage usage = sheet.MemoryUsage();
+    ASSERT(usage.cells > 0);
+    ASSERT(usage.impls > 0);
+    ASSERT(usage.strings > std::string_view("a text too long to be stored in the string object").size());
+    ASSERT(usage.storage > empty.storage);
+    ASSERT(usage.dependencies > empty.dependencies);
+    ASSERT_EQUAL(usage.formulas, 0u);
+
+    // a formula filled down is parsed and counted once
+    sheet.SetCell("B1"_pos, "=A1*2+SUM(A1:A2)");
+    const size_t one_formula = sheet.MemoryUsage().formulas;
+    ASSERT(one_formula > 0);
+    sheet.SetCell("B2"_pos, "=A2*2+SUM(A2:A3)");
+    usage = sheet.MemoryUsage();
+    ASSERT_EQUAL(usage.formulas, one_formula);
+    ASSERT_EQUAL(usage.Total(), usage.storage + usage.cells + usage.impls + usage.formulas
+                                    + usage.dependencies + usage.caches + usage.strings);
+
+    // the referenced cells stay as placeholders until the formulas are cleared
+    for (Position pos : {"B1"_pos, "B2"_pos, "A1"_pos, "A2"_pos, "A3"_pos}) {
+        sheet.ClearCell(pos);
+    }
+    const SheetMemoryUsage cleared = sheet.MemoryUsage();
+    ASSERT_EQUAL(cleared.strings, 0u);
+    ASSERT_EQUAL(cleared.storage, empty.storage);
+
+    // the cleared cells are recycled by the new ones, C1, C2 and the
+    // placeholders D1 and D2; the cached values are counted separately
+    sheet.SetCell("C1"_pos, "=D1+D2");
+    sheet.SetCell("C2"_pos, "text");
+    ASSERT_EQUAL(sheet.MemoryUsage().cells + 4 * sizeof(CachedValue), cleared.cells);
+}
+
+void TestEmptyCellsShareContent() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1+C1");
+    sheet.SetCell("A2"_pos, "text");
+    sheet.ClearCell("A2"_pos);
+    sheet.SetCell("A3"_pos, "");
+    auto* b1 = dynamic_cast<const Cell*>(sheet.GetCell("B1"_pos));
+    auto* a3 = dynamic_cast<const Cell*>(sheet.GetCell("A3"_pos));
+    ASSERT(b1 != nullptr && a3 != nullptr);
+    ASSERT(b1->GetImpl() == a3->GetImpl());
+    ASSERT(b1->HasCachedValue());
+    // only the formula has a content of its own
+    ASSERT_EQUAL(sheet.MemoryUsage().impls, sizeof(Cell::Impl));
+
+    auto* a1 = dynamic_cast<const Cell*>(sheet.GetCell("A1"_pos));
+    ASSERT(!a1->HasCachedValue());
+    ASSERT_EQUAL(std::get<double>(a1->GetValue()), 0.0);
+    ASSERT(a1->HasCachedValue());
+    sheet.SetCell("B1"_pos, "=1/0");
+    ASSERT_EQUAL(std::get<FormulaError>(a1->GetValue()), FormulaError(FormulaError::Category::Div0));
+    ASSERT_EQUAL(std::get<FormulaError>(a1->GetValue()), FormulaError(FormulaError::Category::Div0));
+}
+
+void TestNumberCells() {
+    Sheet sheet;
+    auto content = [&sheet](Position pos) {
+        return dynamic_cast<const Cell*>(sheet.GetCell(pos))->GetImpl();
+    };
+    sheet.SetCell("A1"_pos, "35");
+    sheet.SetCell("A2"_pos, "1.50");
+    sheet.SetCell("A3"_pos, "'35");
+    sheet.SetCell("A4"_pos, "35 apples");
+    sheet.SetCell("B1"_pos, "=SUM(A1:A4)+A2");
+
+    ASSERT(content("A1"_pos)->GetType() == Cell::Impl::ImplType::NUMBER);
+    ASSERT_EQUAL(content("A1"_pos)->GetNumber(), 35.0);
+    ASSERT(content("A2"_pos)->GetType() == Cell::Impl::ImplType::NUMBER);
+    ASSERT(content("A3"_pos)->GetType() == Cell::Impl::ImplType::TEXT);
+    ASSERT(content("A4"_pos)->GetType() == Cell::Impl::ImplType::TEXT);
+
+    // the texts and the string values stay as they were written
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "1.50");
+    ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("A2"_pos)->GetValue()), "1.50");
+    ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("A3"_pos)->GetValue()), "35");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 38.0);
+
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(values.str(), "35\t38\n1.50\t\n35\t\n35 apples\t\n");
+
+    sheet.SetCell("A1"_pos, "thirty five");
+    ASSERT(content("A1"_pos)->GetType() == Cell::Impl::ImplType::TEXT);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 3.0);
+}
+
+void TestObjectPool() {
+    ObjectPool<std::string> pool;
+    auto first = pool.New("first");
+    auto second = pool.New(100, 'x');
+    ASSERT_EQUAL(*first, "first");
+    ASSERT_EQUAL(second->size(), 100u);
+    const size_t memory = pool.GetMemoryUsage();
+    ASSERT(memory >= 2 * sizeof(std::string));
+
+    // a deleted object gives its slot to the next one
+    const std::string* first_address = first.get();
+    first.reset();
+    auto third = pool.New("third");
+    ASSERT(third.get() == first_address);
+    ASSERT_EQUAL(pool.GetMemoryUsage(), memory);
+
+    // a failed constructor returns the slot
+    try {
+        pool.New(std::string("short"), 10, 1);
+        ASSERT(false);
+    } catch (const std::out_of_range&) {
+    }
+    std::vector<ObjectPool<std::string>::Pointer> many;
+    for (int i = 0; i < 1000; ++i) {
+        many.push_back(pool.New(std::to_string(i)));
+    }
+    ASSERT_EQUAL(*many[999], "999");
+    ASSERT(pool.GetMemoryUsage() > memory);
+}
+
 void TestCellCircularReferences() {
     auto sheet = CreateSheet();
     sheet->SetCell("E2"_pos, "=E4");
@@ -345,6 +1353,60 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestCircularReferencesAfterReordering() {
+    // random edits of a small grid, each checked against a full search
+    // of the references written so far
+    auto sheet = CreateSheet();
+    constexpr int SIDE = 4;
+    std::map<Position, std::vector<Position>> references;
+    auto reaches = [&references](Position from, Position to) {
+        std::vector<Position> to_visit{from};
+        std::set<Position> visited;
+        while (!to_visit.empty()) {
+            Position pos = to_visit.back();
+            to_visit.pop_back();
+            if (pos == to) {
+                return true;
+            }
+            if (visited.insert(pos).second) {
+                auto& refs = references[pos];
+                to_visit.insert(to_visit.end(), refs.begin(), refs.end());
+            }
+        }
+        return false;
+    };
+
+    unsigned seed = 12345;
+    auto next_random = [&seed](int bound) {
+        seed = seed * 1103515245 + 12345;
+        return static_cast<int>((seed >> 16) % bound);
+    };
+    for (int step = 0; step < 3000; ++step) {
+        const Position pos{next_random(SIDE), next_random(SIDE)};
+        std::vector<Position> refs;
+        std::string text = "=1";
+        for (int count = next_random(3); count > 0; --count) {
+            refs.push_back(Position{next_random(SIDE), next_random(SIDE)});
+            text += "+" + refs.back().ToString();
+        }
+        bool expect_cycle = false;
+        for (Position ref : refs) {
+            expect_cycle = expect_cycle || reaches(ref, pos);
+        }
+
+        bool caught = false;
+        try {
+            sheet->SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT_EQUAL(caught, expect_cycle);
+        if (!caught) {
+            references[pos] = refs;
+        }
+    }
+}
 }  // namespace
 
 int main() {
@@ -356,17 +1418,43 @@ int main() {
     RUN_TEST(tr, TestInvalidPosition);
     RUN_TEST(tr, TestSetCellPlainText);
     RUN_TEST(tr, TestClearCell);
+    RUN_TEST(tr, TestCellsAcrossTiles);
     RUN_TEST(tr, TestFormulaArithmetic);
+    RUN_TEST(tr, TestFormulaDeepExpression);
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
     RUN_TEST(tr, TestFormulaReferencedCells);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorDiv0);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
+    RUN_TEST(tr, TestNumericValue);
+    RUN_TEST(tr, TestValueView);
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestPrintSparseSheet);
+    RUN_TEST(tr, TestPrintableSizeIsMaintained);
     RUN_TEST(tr, TestCellReferences);
+    RUN_TEST(tr, TestCacheInvalidation);
+    RUN_TEST(tr, TestRecalculate);
+    RUN_TEST(tr, TestRecalculateRuns);
+    RUN_TEST(tr, TestConcurrentReaders);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestSetCells);
     RUN_TEST(tr, TestFormulaIncorrect);
+    RUN_TEST(tr, TestParserMatchesAntlr);
+    RUN_TEST(tr, TestFormulaCache);
+    RUN_TEST(tr, TestSharedFormulaFillDown);
+    RUN_TEST(tr, TestRangeFunctions);
+    RUN_TEST(tr, TestLargeRange);
+    RUN_TEST(tr, TestLargeRangeEdgesAreCheap);
+    RUN_TEST(tr, TestEvaluationProfiler);
+    RUN_TEST(tr, TestProfilerReportKeepsStreamFormat);
+    RUN_TEST(tr, TestSheetStats);
+    RUN_TEST(tr, TestSheetMemoryUsage);
+    RUN_TEST(tr, TestEmptyCellsShareContent);
+    RUN_TEST(tr, TestNumberCells);
+    RUN_TEST(tr, TestObjectPool);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestCircularReferencesAfterReordering);
     return 0;
 }
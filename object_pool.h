@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Slab allocator of the objects of one type owned by one sheet.
+// The objects are built in slots of large slabs; a deleted object returns its
+// slot to a free list, so objects replaced or cleared over and over reuse the
+// same memory without going to the heap. The slabs are released together
+// when the pool is destroyed, after all its objects.
+// The pool is not thread-safe, except that Construct() may be called
+// concurrently for different slots.
+template <typename T>
+class ObjectPool {
+public:
+    // Destroys the object and returns its slot to the pool
+    struct Deleter {
+        ObjectPool* pool = nullptr;
+
+        void operator()(T* object) const {
+            object->~T();
+            pool->Deallocate(object);
+        }
+    };
+
+    using Pointer = std::unique_ptr<T, Deleter>;
+
+    ObjectPool() = default;
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    template <typename... Args>
+    Pointer New(Args&&... args) {
+        void* slot = Allocate();
+        try {
+            return Construct(slot, std::forward<Args>(args)...);
+        } catch (...) {
+            Deallocate(slot);
+            throw;
+        }
+    }
+
+    // Takes a slot for one object
+    void* Allocate() {
+        if (free_) {
+            Slot* slot = free_;
+            free_ = slot->next;
+            return slot;
+        }
+        if (slabs_.empty() || used_in_slab_ == slab_size_) {
+            // the slabs grow, so small sheets stay small and large ones
+            // need few slabs
+            slab_size_ = slabs_.empty() ? MIN_SLAB_SIZE : std::min(slab_size_ * 2, MAX_SLAB_SIZE);
+            slabs_.emplace_back(new Slot[slab_size_]);
+            allocated_bytes_ += slab_size_ * sizeof(Slot);
+            used_in_slab_ = 0;
+        }
+        return &slabs_.back()[used_in_slab_++];
+    }
+
+    // Builds the object in a slot taken by Allocate(); if the constructor
+    // throws, the slot stays taken and must be given to Deallocate()
+    template <typename... Args>
+    Pointer Construct(void* slot, Args&&... args) {
+        return Pointer(new (slot) T(std::forward<Args>(args)...), Deleter{this});
+    }
+
+    // Returns a slot taken by Allocate() with no object in it
+    void Deallocate(void* slot) {
+        Slot* free_slot = static_cast<Slot*>(slot);
+        free_slot->next = free_;
+        free_ = free_slot;
+    }
+
+    // Bytes of the slabs, the free slots included
+    size_t GetMemoryUsage() const {
+        return allocated_bytes_ + slabs_.capacity() * sizeof(slabs_[0]);
+    }
+
+private:
+    union Slot {
+        Slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    static constexpr size_t MIN_SLAB_SIZE = 16;
+    static constexpr size_t MAX_SLAB_SIZE = 4096;
+
+    std::vector<std::unique_ptr<Slot[]>> slabs_;
+    size_t slab_size_ = 0;
+    size_t used_in_slab_ = 0;
+    Slot* free_ = nullptr;
+    size_t allocated_bytes_ = 0;
+};
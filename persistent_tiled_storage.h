@@ -0,0 +1,186 @@
+#pragma once
+
+#include "common.h"
+#include "tiled_storage.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// Copy-on-write variant of TiledStorage for immutable shared values.
+// A copy of the storage shares all the tiles with the original and costs
+// TILE_ROWS pointer copies. A tile (or a row of tiles) is copied only when it is
+// changed while shared, so a copy is a snapshot of the storage and the changes
+// made after it cost O(changed tiles). A copy may be read on other threads while
+// the original is changed.
+template <typename T>
+class PersistentTiledStorage {
+public:
+    using Value = std::shared_ptr<const T>;
+
+    static constexpr int TILE_SIZE = TiledStorage<T>::TILE_SIZE;
+    static constexpr int TILE_ROWS = TiledStorage<T>::TILE_ROWS;
+    static constexpr int TILE_COLS = TiledStorage<T>::TILE_COLS;
+
+    // Returns the stored value or nullptr if the slot is empty.
+    // The position must be valid.
+    const T* Get(Position pos) const {
+        const auto& tile_row = rows_[pos.row / TILE_SIZE];
+        if (!tile_row) {
+            return nullptr;
+        }
+        const auto& tile = tile_row->tiles[pos.col / TILE_SIZE];
+        if (!tile) {
+            return nullptr;
+        }
+        return tile->slots[SlotIndex(pos)].get();
+    }
+
+    // Puts the value into the slot, nullptr empties the slot
+    void Put(Position pos, Value value) {
+        auto& shared_row = rows_[pos.row / TILE_SIZE];
+        if (!value && (!shared_row || !shared_row->tiles[pos.col / TILE_SIZE])) {
+            return;
+        }
+        TileRow& tile_row = Own(shared_row);
+        auto& shared_tile = tile_row.tiles[pos.col / TILE_SIZE];
+        if (!shared_tile) {
+            ++tile_row.tile_count;
+        }
+        Tile& tile = Own(shared_tile);
+
+        auto& slot = tile.slots[SlotIndex(pos)];
+        if (!slot && value) {
+            tile.row_masks[pos.row % TILE_SIZE] |= ColumnBit(pos);
+            ++tile.count;
+            ++size_;
+        } else if (slot && !value) {
+            tile.row_masks[pos.row % TILE_SIZE] &= ~ColumnBit(pos);
+            --tile.count;
+            --size_;
+        }
+        slot = std::move(value);
+
+        if (tile.count == 0) {
+            shared_tile.reset();
+            if (--tile_row.tile_count == 0) {
+                shared_row.reset();
+            }
+        }
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    // Bytes of the storage and its tiles now, the tiles shared with the copies
+    // included; the stored values are not counted
+    size_t GetMemoryUsage() const {
+        size_t bytes = sizeof(*this);
+        for (const auto& tile_row : rows_) {
+            if (tile_row) {
+                bytes += sizeof(TileRow) + tile_row->tile_count * sizeof(Tile);
+            }
+        }
+        return bytes;
+    }
+
+    // Calls func(Position, const T&) for every stored value of the row in column order
+    template <typename Func>
+    void ForEachInRow(int row, Func&& func) const {
+        const auto& tile_row = rows_[row / TILE_SIZE];
+        if (!tile_row) {
+            return;
+        }
+        const int row_in_tile = row % TILE_SIZE;
+        for (int tile_col = 0; tile_col < TILE_COLS; ++tile_col) {
+            const Tile* tile = tile_row->tiles[tile_col].get();
+            if (!tile) {
+                continue;
+            }
+            uint64_t mask = tile->row_masks[row_in_tile];
+            while (mask) {
+                const int col_in_tile = tiled_storage_detail::CountTrailingZeros(mask);
+                mask &= mask - 1;
+                func(Position{row, tile_col * TILE_SIZE + col_in_tile},
+                     *tile->slots[row_in_tile * TILE_SIZE + col_in_tile]);
+            }
+        }
+    }
+
+    // Calls func(Position, const T&) for every stored value of the valid range
+    // in row-major order
+    template <typename Func>
+    void ForEachInRange(CellRange range, Func&& func) const {
+        const int first_tile_col = range.first.col / TILE_SIZE;
+        const int last_tile_col = range.last.col / TILE_SIZE;
+        for (int row = range.first.row; row <= range.last.row; ++row) {
+            const auto& tile_row = rows_[row / TILE_SIZE];
+            if (!tile_row) {
+                // the rest of the rows of the tile are empty too
+                row = (row / TILE_SIZE + 1) * TILE_SIZE - 1;
+                continue;
+            }
+            const int row_in_tile = row % TILE_SIZE;
+            for (int tile_col = first_tile_col; tile_col <= last_tile_col; ++tile_col) {
+                const Tile* tile = tile_row->tiles[tile_col].get();
+                if (!tile) {
+                    continue;
+                }
+                uint64_t mask = tile->row_masks[row_in_tile];
+                if (tile_col == first_tile_col) {
+                    mask &= ~uint64_t{0} << (range.first.col % TILE_SIZE);
+                }
+                if (tile_col == last_tile_col) {
+                    mask &= ~uint64_t{0} >> (TILE_SIZE - 1 - range.last.col % TILE_SIZE);
+                }
+                while (mask) {
+                    const int col_in_tile = tiled_storage_detail::CountTrailingZeros(mask);
+                    mask &= mask - 1;
+                    func(Position{row, tile_col * TILE_SIZE + col_in_tile},
+                         *tile->slots[row_in_tile * TILE_SIZE + col_in_tile]);
+                }
+            }
+        }
+    }
+
+private:
+    struct Tile {
+        std::array<Value, TILE_SIZE * TILE_SIZE> slots;
+        // bit N of row_masks[R] is set when the slot (R, N) holds a value
+        std::array<uint64_t, TILE_SIZE> row_masks{};
+        int count = 0;
+    };
+
+    struct TileRow {
+        std::array<std::shared_ptr<Tile>, TILE_COLS> tiles;
+        int tile_count = 0;
+    };
+
+    static int SlotIndex(Position pos) {
+        return (pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE;
+    }
+
+    static uint64_t ColumnBit(Position pos) {
+        return uint64_t{1} << (pos.col % TILE_SIZE);
+    }
+
+    // Makes the node owned by this storage only, copying it if it is shared
+    template <typename Node>
+    static Node& Own(std::shared_ptr<Node>& node) {
+        if (!node) {
+            node = std::make_shared<Node>();
+        } else if (node.use_count() > 1) {
+            node = std::make_shared<Node>(*node);
+        } else {
+            // the last other owner may have just released the node
+            // on another thread, its reads must happen before the changes
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        return *node;
+    }
+
+    std::array<std::shared_ptr<TileRow>, TILE_ROWS> rows_;
+    size_t size_ = 0;
+};
@@ -0,0 +1,223 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <optional>
+
+namespace {
+//The innermost evaluation of the current thread
+thread_local EvaluationProfiler::Scope* current_scope = nullptr;
+
+double ToMicroseconds(std::chrono::nanoseconds time) {
+    return std::chrono::duration<double, std::micro>(time).count();
+}
+
+//Restores the formatting of the stream on the way out of the report
+class StreamFormatGuard {
+public:
+    explicit StreamFormatGuard(std::ostream& out)
+        : out_(out)
+        , flags_(out.flags())
+        , precision_(out.precision())
+        , fill_(out.fill()) {
+    }
+
+    StreamFormatGuard(const StreamFormatGuard&) = delete;
+    StreamFormatGuard& operator=(const StreamFormatGuard&) = delete;
+
+    ~StreamFormatGuard() {
+        out_.flags(flags_);
+        out_.precision(precision_);
+        out_.fill(fill_);
+    }
+
+private:
+    std::ostream& out_;
+    std::ios_base::fmtflags flags_;
+    std::streamsize precision_;
+    char fill_;
+};
+}  // namespace
+
+EvaluationProfiler& EvaluationProfiler::Instance() {
+    static EvaluationProfiler profiler;
+    return profiler;
+}
+
+EvaluationProfiler::Scope::Scope(Position pos)
+    : pos_(pos)
+    , start_(std::chrono::steady_clock::now())
+    , parent_(current_scope)
+    , depth_(current_scope ? current_scope->depth_ + 1 : 0) {
+    current_scope = this;
+}
+
+EvaluationProfiler::Scope::~Scope() {
+    const std::chrono::nanoseconds inclusive_time = std::chrono::steady_clock::now() - start_;
+    current_scope = parent_;
+    if (parent_) {
+        parent_->nested_time_ += inclusive_time;
+    }
+    Instance().RecordEvaluation(*this, inclusive_time);
+}
+
+void EvaluationProfiler::RecordLookup(Position pos, bool hit) {
+    std::lock_guard lock(mutex_);
+    CellProfile& profile = profiles_[pos];
+    profile.pos = pos;
+    ++(hit ? profile.cache_hits : profile.cache_misses);
+    if (current_scope) {
+        references_[current_scope->pos_].insert(pos);
+    }
+}
+
+void EvaluationProfiler::RecordInstructions(size_t count) {
+    if (current_scope) {
+        current_scope->instructions_ += count;
+    }
+}
+
+void EvaluationProfiler::RecordEvaluation(const Scope& scope, std::chrono::nanoseconds inclusive_time) {
+    std::lock_guard lock(mutex_);
+    CellProfile& profile = profiles_[scope.pos_];
+    profile.pos = scope.pos_;
+    ++profile.evaluations;
+    profile.instructions += scope.instructions_;
+    profile.inclusive_time += inclusive_time;
+    profile.exclusive_time += inclusive_time - scope.nested_time_;
+    profile.max_depth = std::max(profile.max_depth, scope.depth_);
+    if (scope.parent_) {
+        references_[scope.parent_->pos_].insert(scope.pos_);
+    }
+}
+
+void EvaluationProfiler::Reset() {
+    std::lock_guard lock(mutex_);
+    profiles_.clear();
+    references_.clear();
+}
+
+std::vector<CellProfile> EvaluationProfiler::GetProfiles() const {
+    std::lock_guard lock(mutex_);
+    std::vector<CellProfile> profiles;
+    profiles.reserve(profiles_.size());
+    for (const auto& [pos, profile] : profiles_) {
+        profiles.push_back(profile);
+    }
+    return profiles;
+}
+
+std::vector<CellProfile> EvaluationProfiler::GetTopCells(size_t count) const {
+    std::vector<CellProfile> profiles = GetProfiles();
+    count = std::min(count, profiles.size());
+    std::partial_sort(profiles.begin(), profiles.begin() + count, profiles.end(),
+                      [](const CellProfile& lhs, const CellProfile& rhs) {
+                          return lhs.exclusive_time > rhs.exclusive_time;
+                      });
+    profiles.resize(count);
+    return profiles;
+}
+
+std::vector<CellProfile> EvaluationProfiler::GetCriticalPath() const {
+    std::lock_guard lock(mutex_);
+
+//The cost of a cell is its exclusive time plus the largest cost of its
+//references. The references are walked without recursion, so long chains
+//do not overflow the stack; a reference back to a cell being walked (possible
+//only for cells of different sheets) is ignored
+    struct PathStep {
+        enum class State { NEW, WALKED, DONE } state = State::NEW;
+        std::chrono::nanoseconds cost{0};
+        std::optional<Position> next;
+    };
+    std::map<Position, PathStep> steps;
+    const std::set<Position> no_references;
+    auto references_of = [this, &no_references](Position pos) -> const std::set<Position>& {
+        auto it = references_.find(pos);
+        return it == references_.end() ? no_references : it->second;
+    };
+
+    std::optional<Position> root;
+    for (const auto& [pos, profile] : profiles_) {
+        std::vector<Position> to_visit{pos};
+        while (!to_visit.empty()) {
+            const Position current = to_visit.back();
+            PathStep& step = steps[current];
+            if (step.state == PathStep::State::DONE) {
+                to_visit.pop_back();
+                continue;
+            }
+            const std::set<Position>& references = references_of(current);
+            if (step.state == PathStep::State::NEW) {
+                step.state = PathStep::State::WALKED;
+                for (Position reference : references) {
+                    if (profiles_.count(reference) && steps[reference].state == PathStep::State::NEW) {
+                        to_visit.push_back(reference);
+                    }
+                }
+                continue;
+            }
+            for (Position reference : references) {
+                const PathStep& referenced = steps[reference];
+                if (referenced.state == PathStep::State::DONE
+                    && (!step.next || referenced.cost > steps[*step.next].cost)) {
+                    step.next = reference;
+                }
+            }
+            step.cost = profiles_.at(current).exclusive_time + (step.next ? steps[*step.next].cost
+                                                                           : std::chrono::nanoseconds{0});
+            step.state = PathStep::State::DONE;
+            to_visit.pop_back();
+        }
+        if (!root || steps[pos].cost > steps[*root].cost) {
+            root = pos;
+        }
+    }
+
+    std::vector<CellProfile> path;
+    for (std::optional<Position> current = root; current; current = steps[*current].next) {
+        path.push_back(profiles_.at(*current));
+    }
+    std::reverse(path.begin(), path.end());
+    return path;
+}
+
+void EvaluationProfiler::PrintReport(std::ostream& out, size_t top_count) const {
+    const StreamFormatGuard format_guard(out);
+    auto print_header = [&out] {
+        out << std::left << std::setw(10) << "cell" << std::right << std::setw(8) << "evals"
+            << std::setw(8) << "hits" << std::setw(8) << "misses" << std::setw(12) << "instrs"
+            << std::setw(14) << "incl us" << std::setw(14) << "excl us" << std::setw(7) << "depth"
+            << '\n';
+    };
+    auto print_profile = [&out](const CellProfile& profile) {
+        out << std::left << std::setw(10) << profile.pos.ToString() << std::right << std::setw(8)
+            << profile.evaluations << std::setw(8) << profile.cache_hits << std::setw(8)
+            << profile.cache_misses << std::setw(12) << profile.instructions << std::fixed
+            << std::setprecision(1) << std::setw(14) << ToMicroseconds(profile.inclusive_time)
+            << std::setw(14) << ToMicroseconds(profile.exclusive_time) << std::setw(7)
+            << profile.max_depth << '\n';
+    };
+
+    if (!ENABLED) {
+        out << "The profiler is not built in, define SPREADSHEET_PROFILE\n";
+        return;
+    }
+    out << "Most expensive cells by exclusive time:\n";
+    print_header();
+    for (const CellProfile& profile : GetTopCells(top_count)) {
+        print_profile(profile);
+    }
+
+    const std::vector<CellProfile> path = GetCriticalPath();
+    std::chrono::nanoseconds path_time{0};
+    for (const CellProfile& profile : path) {
+        path_time += profile.exclusive_time;
+    }
+    out << "Critical path, " << path.size() << " cells, " << std::fixed << std::setprecision(1)
+        << ToMicroseconds(path_time) << " us:\n";
+    print_header();
+    for (const CellProfile& profile : path) {
+        print_profile(profile);
+    }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <vector>
+
+// Opt-in profiler of the cell evaluations. It is built into the cells and
+// formulas only when SPREADSHEET_PROFILE is defined (cmake -DSPREADSHEET_PROFILE=ON),
+// otherwise the PROFILE_* hooks expand to nothing and the profiler stays empty.
+//
+// The profiler is process-wide and keeps the cells by position, so it should
+// profile one sheet at a time; Reset() it before the measured work.
+// Reading a cell while another cell is evaluated is a reference between them,
+// so the references are recorded even when the value is taken from the cache.
+
+// What the evaluations of one cell cost
+struct CellProfile {
+    Position pos;
+    uint64_t evaluations = 0;
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    // instructions of the formula executed by the evaluations
+    uint64_t instructions = 0;
+    // the time of the evaluations with and without the cells evaluated by them
+    std::chrono::nanoseconds inclusive_time{0};
+    std::chrono::nanoseconds exclusive_time{0};
+    // the deepest nesting of the evaluations of other cells this one was evaluated in
+    int max_depth = 0;
+};
+
+class EvaluationProfiler {
+public:
+#ifdef SPREADSHEET_PROFILE
+    static constexpr bool ENABLED = true;
+#else
+    static constexpr bool ENABLED = false;
+#endif
+
+    static EvaluationProfiler& Instance();
+
+    // Times the evaluation of a cell on the current thread, the evaluations
+    // nested in it are its references
+    class Scope {
+    public:
+        explicit Scope(Position pos);
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+        ~Scope();
+
+    private:
+        Position pos_;
+        std::chrono::steady_clock::time_point start_;
+        std::chrono::nanoseconds nested_time_{0};
+        uint64_t instructions_ = 0;
+        Scope* parent_;
+        int depth_;
+
+        friend class EvaluationProfiler;
+    };
+
+    // A formula read the value of the cell, hit tells if it was cached
+    void RecordLookup(Position pos, bool hit);
+
+    // The innermost evaluation executed so many instructions
+    void RecordInstructions(size_t count);
+
+    void Reset();
+
+    // The profiles of all the evaluated cells, sorted by position
+    std::vector<CellProfile> GetProfiles() const;
+
+    // At most count cells with the largest exclusive time, the most expensive first
+    std::vector<CellProfile> GetTopCells(size_t count) const;
+
+    // The chain of references with the largest total exclusive time, from the
+    // cell evaluated first to the one read last: no parallel recalculation
+    // can take less time than it
+    std::vector<CellProfile> GetCriticalPath() const;
+
+    // Prints the top cells and the critical path as text tables
+    void PrintReport(std::ostream& out, size_t top_count = 10) const;
+
+private:
+    void RecordEvaluation(const Scope& scope, std::chrono::nanoseconds inclusive_time);
+
+    mutable std::mutex mutex_;
+    std::map<Position, CellProfile> profiles_;
+    std::map<Position, std::set<Position>> references_;
+};
+
+#ifdef SPREADSHEET_PROFILE
+#define PROFILE_CELL_LOOKUP(pos, hit) EvaluationProfiler::Instance().RecordLookup((pos), (hit))
+#define PROFILE_CELL_EVALUATION(pos) EvaluationProfiler::Scope profile_evaluation_scope(pos)
+#define PROFILE_INSTRUCTIONS(count) EvaluationProfiler::Instance().RecordInstructions(count)
+#else
+#define PROFILE_CELL_LOOKUP(pos, hit) ((void)0)
+#define PROFILE_CELL_EVALUATION(pos) ((void)0)
+#define PROFILE_INSTRUCTIONS(count) ((void)0)
+#endif
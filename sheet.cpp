@@ -1,28 +1,48 @@
 #include "sheet.h"
 
+#include "buffered_output.h"
 #include "cell.h"
 #include "common.h"
+#include "profiler.h"
+#include "snapshot.h"
 
 #include <algorithm>
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <thread>
+#include <unordered_set>
 
 using namespace std::literals;
 
+namespace {
+//The longest run of cells calculated by one EvaluateBatch() call,
+//longer runs are split so the threads share the work
+constexpr size_t MAX_RUN_SIZE = 256;
+}  // namespace
+
 Sheet::~Sheet() {}
 
-Size Sheet::ComputePrintSize() const {
-    if (sheet_.empty()) {
-        return {0, 0};
+void Sheet::UpdatePrintableSize(Position pos, bool was_printable, bool is_printable) {
+    if (was_printable == is_printable) {
+        return;
+    }
+    if (is_printable) {
+        ++row_occupancy_[pos.row];
+        ++col_occupancy_[pos.col];
+        printable_size_.rows = std::max(printable_size_.rows, pos.row + 1);
+        printable_size_.cols = std::max(printable_size_.cols, pos.col + 1);
+        return;
     }
-    int max_row = 0;
-    int max_col = 0;
-    for (const auto& [pos, cell] : sheet_) {
-        max_row = max_row >= pos.row ? max_row : pos.row;
-        max_col = max_col >= pos.col ? max_col : pos.col;
+    --row_occupancy_[pos.row];
+    --col_occupancy_[pos.col];
+//The bounds shrink only when the last cell of the edge row or column is emptied
+    while (printable_size_.rows > 0 && row_occupancy_[printable_size_.rows - 1] == 0) {
+        --printable_size_.rows;
+    }
+    while (printable_size_.cols > 0 && col_occupancy_[printable_size_.cols - 1] == 0) {
+        --printable_size_.cols;
     }
-    return {max_row + 1, max_col + 1};
 }
 
 void Sheet::SetCell(Position pos, std::string text) {
@@ -30,149 +50,440 @@ void Sheet::SetCell(Position pos, std::string text) {
         throw InvalidPositionException("Trying SetCell with Invalid position");
     }
 
-    std::unique_ptr new_cell_ptr = std::make_unique<Cell>(*this, text);
+    ObjectPool<Cell>::Pointer new_cell_ptr = cell_pool_.New(*this, pos, std::move(text));
+    FormulaReferences references = new_cell_ptr->GetReferences();
 
-    CycleDependencyFound(new_cell_ptr.get(), pos);
+    Cell* old_cell = sheet_.Get(pos);
+    if (!old_cell && std::binary_search(references.cells.begin(), references.cells.end(), pos)) {
+//A new cell has no direct dependents, a reference to itself makes a cycle
+        throw CircularDependencyException("");
+    }
 
-//If the cell is already initialized,
-//then copy the dependencies to a new cell
-    if (sheet_.count(pos)) {
-        sheet_[pos]->RemoveOldLinks(pos);
-        new_cell_ptr->AddOldDependents(sheet_[pos]->GetDependentsCells());
+//If the cell is already initialized, the new cell takes its node
+//together with the dependencies and the order. A new node is added before
+//the check, since the ranges of other cells may already cover the position
+    const bool was_printable = old_cell && !old_cell->IsEmpty();
+    const DependencyGraph::NodeId node = old_cell ? old_cell->GetNode()
+                                                  : graph_.AddNode(pos, next_order_++);
+    std::vector<DependencyGraph::NodeId> ref_nodes;
+    for (Position ref : references.cells) {
+        if (const Cell* ref_cell = sheet_.Get(ref)) {
+            ref_nodes.push_back(ref_cell->GetNode());
+        }
     }
+    try {
+        graph_.RestoreOrder(node, ref_nodes, references.ranges);
+    } catch (const CircularDependencyException&) {
+        if (!old_cell) {
+            graph_.RemoveNode(node);
+        }
+        throw;
+    }
+    new_cell_ptr->SetNode(node);
+    graph_.SetReferences(node, SafeGetRefNodes(references.cells), std::move(references.ranges));
+
+    UpdatePrintableSize(pos, was_printable, !new_cell_ptr->IsEmpty());
+    sheet_.Put(pos, std::move(new_cell_ptr));
+    UpdateContents(pos);
+    MarkDirty(node);
+    ResetDependentsCache({node});
+}
 
-    new_cell_ptr->UpdateReferencedCells();
+void Sheet::SetCells(const std::vector<std::pair<Position, std::string>>& cells, size_t threads) {
+    for (const auto& [pos, text] : cells) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Trying SetCells with Invalid position");
+        }
+    }
+
+//Only the last text for a position is set, the edits are sorted by position
+    std::vector<size_t> order(cells.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&cells](size_t lhs, size_t rhs) {
+        return cells[lhs].first < cells[rhs].first;
+    });
+    std::vector<CellEdit> edits;
+    edits.reserve(cells.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (i + 1 < order.size() && cells[order[i + 1]].first == cells[order[i]].first) {
+            continue;
+        }
+        CellEdit edit;
+        edit.pos = cells[order[i]].first;
+        edit.text = &cells[order[i]].second;
+        edits.push_back(std::move(edit));
+    }
+
+//Parsing does not touch the sheet, a FormulaException leaves it unchanged.
+//The pool is not thread-safe, so the slots are taken before the cells are
+//built in them in parallel
+    for (CellEdit& edit : edits) {
+        edit.slot = cell_pool_.Allocate();
+    }
+    try {
+        GetPool(threads).ParallelFor(edits.size(), [this, &edits](size_t i) {
+            CellEdit& edit = edits[i];
+            edit.cell = cell_pool_.Construct(edit.slot, *this, edit.pos, *edit.text);
+            edit.references = edit.cell->GetReferences();
+        });
+    } catch (...) {
+        for (const CellEdit& edit : edits) {
+            if (!edit.cell) {
+                cell_pool_.Deallocate(edit.slot);
+            }
+        }
+        throw;
+    }
+
+    LinkEdits(edits);
+
+//The new cells are put first, so the references between them
+//do not create placeholders
+    std::vector<DependencyGraph::NodeId> nodes;
+    nodes.reserve(edits.size());
+    for (CellEdit& edit : edits) {
+        const Cell* old_cell = sheet_.Get(edit.pos);
+        UpdatePrintableSize(edit.pos, old_cell && !old_cell->IsEmpty(), !edit.cell->IsEmpty());
+        edit.cell->SetNode(edit.node);
+        sheet_.Put(edit.pos, std::move(edit.cell));
+        UpdateContents(edit.pos);
+        nodes.push_back(edit.node);
+    }
+//The edits are linked by LinkEdits(), only the placeholders are left;
+//they are ordered before all the other cells, so the order stays valid
+    for (CellEdit& edit : edits) {
+        if (!edit.missing_references.empty()) {
+            graph_.AddReferences(edit.node, SafeGetRefNodes(edit.missing_references));
+        }
+        MarkDirty(edit.node);
+    }
+    ResetDependentsCache(nodes);
+}
+
+void Sheet::LinkEdits(std::vector<CellEdit>& edits) {
+    for (CellEdit& edit : edits) {
+        const Cell* old_cell = sheet_.Get(edit.pos);
+        edit.is_new = !old_cell;
+        edit.node = old_cell ? old_cell->GetNode() : graph_.AddNode(edit.pos, next_order_++);
+    }
+//Cells that do not exist yet and are not edited have no links, they cannot
+//be a part of a cycle and get their placeholders later
+    auto known_ref_nodes = [this, &edits](CellEdit& edit) {
+        std::vector<DependencyGraph::NodeId> ref_nodes;
+        edit.missing_references.clear();
+        for (Position ref : edit.references.cells) {
+            auto it = std::lower_bound(edits.begin(), edits.end(), ref, [](const CellEdit& edit, Position pos) {
+                return edit.pos < pos;
+            });
+            if (it != edits.end() && it->pos == ref) {
+                ref_nodes.push_back(it->node);
+            } else if (const Cell* ref_cell = sheet_.Get(ref)) {
+                ref_nodes.push_back(ref_cell->GetNode());
+            } else {
+                edit.missing_references.push_back(ref);
+            }
+        }
+        return ref_nodes;
+    };
+
+//With the old references of all the edited cells removed, the new ones are
+//added one by one. Every intermediate graph is a part of the final one,
+//so a cycle is found exactly when the final graph has it
+    for (CellEdit& edit : edits) {
+        edit.old_ref_nodes = graph_.GetReferences(edit.node);
+        edit.old_ranges = graph_.GetRanges(edit.node);
+        graph_.SetReferences(edit.node, {});
+    }
+    size_t linked = 0;
+    try {
+        for (; linked < edits.size(); ++linked) {
+            CellEdit& edit = edits[linked];
+            auto ref_nodes = known_ref_nodes(edit);
+            graph_.RestoreOrder(edit.node, ref_nodes, edit.references.ranges);
+            graph_.SetReferences(edit.node, std::move(ref_nodes), std::move(edit.references.ranges));
+        }
+    } catch (const CircularDependencyException&) {
+//The old graph has no cycles, restoring it cannot fail
+        for (size_t i = 0; i < linked; ++i) {
+            graph_.SetReferences(edits[i].node, {});
+        }
+        for (CellEdit& edit : edits) {
+            graph_.RestoreOrder(edit.node, edit.old_ref_nodes, edit.old_ranges);
+            graph_.SetReferences(edit.node, std::move(edit.old_ref_nodes), std::move(edit.old_ranges));
+        }
+        for (const CellEdit& edit : edits) {
+            if (edit.is_new) {
+                graph_.RemoveNode(edit.node);
+            }
+        }
+        throw;
+    }
+}
 
 //If the cell we want to add references(depends) to uninitialized cells,
-//then in this method we initialize the necessary cells as empty 
-//and we add dependencies to them, in order not to lose dependencies in the future
-    SafeAddDependForRefCells(new_cell_ptr.get(), pos);
+//then in this method we initialize the necessary cells as empty, 
+//in order not to lose dependencies in the future
+std::vector<DependencyGraph::NodeId> Sheet::SafeGetRefNodes(const std::vector<Position>& ref_cells) {
+    std::vector<DependencyGraph::NodeId> ref_nodes;
+    ref_nodes.reserve(ref_cells.size());
+    for (Position ref : ref_cells) {
+        Cell* ref_cell = sheet_.Get(ref);
+        if (!ref_cell) {
+            auto placeholder = cell_pool_.New(*this, ref);
+            SheetCounters::Add(counters_.placeholders_created);
+            placeholder->SetNode(graph_.AddNode(ref, next_placeholder_order_--));
+            ref_cell = placeholder.get();
+            sheet_.Put(ref, std::move(placeholder));
+            UpdateContents(ref);
+            MarkDirty(ref_cell->GetNode());
+        }
+        ref_nodes.push_back(ref_cell->GetNode());
+    }
+    return ref_nodes;
+}
 
-    sheet_[pos] = std::move(new_cell_ptr);   
+void Sheet::ResetDependentsCache(const std::vector<DependencyGraph::NodeId>& nodes) {
+    uint64_t invalidated = 0;
+    graph_.ForEachDependent(nodes, [this, &invalidated](DependencyGraph::NodeId dependent) {
+        GetNodeCell(dependent)->ResetCache();
+        MarkDirty(dependent);
+        ++invalidated;
+    });
+    SheetCounters::Add(counters_.cells_invalidated, invalidated);
 }
 
-void Sheet::SafeAddDependForRefCells(CellInterface* depend_cell, Position pos) {
-    if (!depend_cell) {
-        return;
+Cell* Sheet::GetNodeCell(DependencyGraph::NodeId node) const {
+    return sheet_.Get(graph_.GetPosition(node));
+}
+
+void Sheet::MarkDirty(DependencyGraph::NodeId node) {
+    if (node >= listed_dirty_.size()) {
+        listed_dirty_.resize(node + 1);
+    }
+    if (!listed_dirty_[node]) {
+        listed_dirty_[node] = true;
+        dirty_nodes_.push_back(node);
     }
-    auto ref_cells = depend_cell->GetReferencedCells();
-    std::for_each(begin(ref_cells), end(ref_cells),
-                  [&pos, this](auto ref_cell_pos) { if (!sheet_.count(ref_cell_pos)) {
-                                                        sheet_[ref_cell_pos] = std::make_unique<Cell>(*this);
-                                                    }
-                                                        sheet_[ref_cell_pos]->AddDependency(pos);});
+}
+
+bool Sheet::IsDirty(DependencyGraph::NodeId node) const {
+    const Cell* cell = GetNodeCell(node);
+    return cell && cell->GetNode() == node && !cell->HasCachedValue();
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Trying GetCell with Invalid position");
     }
-    if (sheet_.empty() || sheet_.count(pos) == 0) {
-        return nullptr;
-    }
-    return sheet_.at(pos).get();
+    return sheet_.Get(pos);
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Trying GetCell with Invalid position");
     }
-    if (sheet_.empty() || sheet_.count(pos) == 0) {
-        return nullptr;
-    }
-    return sheet_[pos].get();
+    return sheet_.Get(pos);
+}
+
+void Sheet::ForEachCellInRange(CellRange range,
+                               const std::function<void(Position, const CellInterface&)>& func) const {
+    sheet_.ForEachInRange(range, [&func](Position pos, const Cell& cell) {
+        func(pos, cell);
+    });
 }
 
 void Sheet::ClearCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Trying ClearCell with Invalid position");
     }
-    if (sheet_.empty() || sheet_.count(pos) == 0) {
+    Cell* cell = sheet_.Get(pos);
+    if (!cell) {
         return;
     }
+    UpdatePrintableSize(pos, !cell->IsEmpty(), false);
 //An empty cell does not depend on others, then in the cells, previously
 //referenced by the current cell delete this position like "dependence cell"
-    sheet_[pos]->RemoveOldLinks(pos);
-    sheet_[pos]->Clear();
-    sheet_.erase(pos);
+    const DependencyGraph::NodeId node = cell->GetNode();
+    graph_.SetReferences(node, {});
+    cell->Clear();
+    ResetDependentsCache({node});
+//A cell that other formulas still depend on stays as an empty placeholder,
+//otherwise these dependencies would be lost
+    if (graph_.GetDependents(node).empty()) {
+        graph_.RemoveNode(node);
+        sheet_.Take(pos);
+    } else {
+        MarkDirty(node);
+    }
+    UpdateContents(pos);
 }
 
-Size Sheet::GetPrintableSize() const {
-    return ComputePrintSize();
+SheetStats Sheet::GetStats() const {
+    SheetStats stats = counters_.Load();
+    stats.cycle_check_nodes = graph_.GetCycleCheckVisits();
+    stats.graph_bytes = graph_.GetAllocatedBytes();
+    stats.storage_bytes = sheet_.GetAllocatedBytes();
+    return stats;
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-      auto print_ = [&output](const auto& obj) { output << obj; };
-    Size sheet_area = GetPrintableSize();
-
-    for (int row = 0; row < sheet_area.rows; ++row) {
-        bool row_space_flag = false;
-        for (int col = 0; col < sheet_area.cols; ++col) {
-            Position pos{ row, col };
-            auto cell = GetCell(pos);
+SheetMemoryUsage Sheet::MemoryUsage() const {
+    SheetMemoryUsage usage;
+    usage.storage = sheet_.GetMemoryUsage() + contents_.GetMemoryUsage()
+                    + (row_occupancy_.capacity() + col_occupancy_.capacity()) * sizeof(int);
+    usage.dependencies = graph_.GetMemoryUsage();
+    usage.caches = dirty_nodes_.capacity() * sizeof(DependencyGraph::NodeId) + listed_dirty_.capacity() / 8;
 
-            if (row_space_flag) {
-                output << '\t';
-            }
-            if (cell) {
-                std::visit(print_, cell->GetValue());
-            }
-            row_space_flag = true;
+//The contents shared with the snapshots are still held by the sheet,
+//so they are counted as its own
+    std::unordered_set<const SharedFormula*> formulas;
+    size_t cell_count = 0;
+    sheet_.ForEach([&](Position, const Cell& cell) {
+        ++cell_count;
+        const std::shared_ptr<const Cell::Impl> impl = cell.GetImpl();
+        const size_t text_bytes = impl->GetTextBytes();
+        usage.impls += impl->GetAllocatedBytes() - text_bytes;
+        usage.strings += text_bytes;
+        const SharedFormula* formula = impl->GetSharedFormula();
+        if (formula && formulas.insert(formula).second) {
+            usage.formulas += formula->GetAllocatedBytes();
         }
-        output << std::endl;
-    }
+    });
+//The free slots of the pool are counted with the cells
+    usage.cells = cell_pool_.GetMemoryUsage() - cell_count * sizeof(CachedValue);
+    usage.caches += cell_count * sizeof(CachedValue);
+    return usage;
 }
 
-void Sheet::PrintTexts(std::ostream& output) const {
-    Size sheet_area = GetPrintableSize();
-
-    for (int row = 0; row < sheet_area.rows; ++row) {
-        bool row_space_flag = false;
-        for (int col = 0; col < sheet_area.cols; ++col) {
-            Position pos{ row, col };
-            auto cell = GetCell(pos);
+void Sheet::UpdateContents(Position pos) {
+    if (contents_tracked_) {
+        const Cell* cell = sheet_.Get(pos);
+        contents_.Put(pos, cell ? cell->GetImpl() : nullptr);
+    }
+}
 
-            if (row_space_flag) {
-                output << '\t';
-            }
-            if (cell) {
-                output << cell->GetText();
-            }
-            row_space_flag = true;
-        }
-        output << std::endl;
+std::shared_ptr<const SheetInterface> Sheet::Snapshot() {
+    if (!contents_tracked_) {
+        sheet_.ForEach([this](Position pos, const Cell& cell) {
+            contents_.Put(pos, cell.GetImpl());
+        });
+        contents_tracked_ = true;
     }
+    return std::make_shared<SheetSnapshot>(contents_, printable_size_);
 }
 
-std::unique_ptr<SheetInterface> CreateSheet() {
-    return std::make_unique<Sheet>();
+Size Sheet::GetPrintableSize() const {
+    return printable_size_;
 }
 
-void Sheet::CycleDependencyFound(CellInterface* tmp_cell, Position pos) {
-    std::vector<Position> cells_to_check = tmp_cell->GetReferencedCells();
-    std::set<Position> checked_positions;
+void Sheet::PrintValues(std::ostream& output) const {
+    PrintArea(sheet_, GetPrintableSize(), output, [](Position, const Cell& cell, BufferedOutput& out) {
+        std::visit([&out](const auto& value) { out.Put(value); }, cell.GetValueView());
+    });
+}
 
-    while (!cells_to_check.empty()) {
-        Position current_pos = cells_to_check[0];
-        if (current_pos == pos) {
-            throw CircularDependencyException("");
+void Sheet::PrintTexts(std::ostream& output) const {
+    PrintArea(sheet_, GetPrintableSize(), output, [](Position, const Cell& cell, BufferedOutput& out) {
+        out.Put(cell.GetText());
+    });
+}
+
+void Sheet::Recalculate(size_t threads) {
+    std::vector<DependencyGraph::NodeId> dirty;
+    for (DependencyGraph::NodeId node : dirty_nodes_) {
+        listed_dirty_[node] = false;
+        if (IsDirty(node)) {
+            dirty.push_back(node);
         }
-        if (checked_positions.count(current_pos)){
-            cells_to_check.erase(cells_to_check.begin());
-            continue;
+    }
+    dirty_nodes_.clear();
+//Referenced cells never calculated are calculated too,
+//then no cell is calculated on demand during the parallel part
+    auto levels = graph_.Levelize(dirty, [this](DependencyGraph::NodeId node) {
+        return !GetNodeCell(node)->HasCachedValue();
+    });
+
+    ThreadPool& pool = GetPool(threads);
+//A cell of a level reads only the cells of the previous levels
+//and the already calculated ones, so the cells of a level are independent
+//and a run of them sharing a formula is calculated as one batch
+    for (const auto& level : levels) {
+        const LevelRuns runs = SplitIntoRuns(level);
+        pool.ParallelFor(runs.formulas.size(), [this, &runs](size_t index) {
+            const Position* cells = runs.cells.data() + runs.runs[index];
+            const size_t count = runs.runs[index + 1] - runs.runs[index];
+            if (const SharedFormula* formula = runs.formulas[index]) {
+                CalculateRun(*formula, cells, count);
+            } else {
+                sheet_.Get(*cells)->GetValue();
+            }
+        });
+    }
+}
+
+Sheet::LevelRuns Sheet::SplitIntoRuns(const std::vector<DependencyGraph::NodeId>& level) const {
+    struct Entry {
+        const SharedFormula* formula;
+        Position pos;
+    };
+    std::vector<Entry> entries;
+    entries.reserve(level.size());
+    for (DependencyGraph::NodeId node : level) {
+        const Position pos = graph_.GetPosition(node);
+//The profiled build calculates the cells one by one, so every cell has its profile
+        const SharedFormula* formula = EvaluationProfiler::ENABLED ? nullptr
+                                                                   : sheet_.Get(pos)->GetImpl()->GetSharedFormula();
+        entries.push_back({formula, pos});
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& lhs, const Entry& rhs) {
+        if (lhs.formula != rhs.formula) {
+            return std::less<const SharedFormula*>()(lhs.formula, rhs.formula);
         }
-        checked_positions.insert(current_pos);
-        CellInterface* cell;
-        try {
-            cell = GetCell(current_pos);
-        } catch (InvalidPositionException&) {
-            cell = nullptr;
+        return std::pair(lhs.pos.col, lhs.pos.row) < std::pair(rhs.pos.col, rhs.pos.row);
+    });
+
+    LevelRuns runs;
+    runs.cells.reserve(entries.size());
+    for (size_t index = 0; index < entries.size(); ++index) {
+        const Entry& entry = entries[index];
+        const size_t run_size = runs.cells.size() - (runs.runs.empty() ? 0 : runs.runs.back());
+        const bool continues = index > 0 && entry.formula && entry.formula == entries[index - 1].formula
+                               && entry.pos.col == entries[index - 1].pos.col
+                               && entry.pos.row == entries[index - 1].pos.row + 1 && run_size < MAX_RUN_SIZE;
+        if (!continues) {
+            runs.runs.push_back(runs.cells.size());
+            runs.formulas.push_back(entry.formula);
         }
-        if (cell){       
-            for (auto cell_ : cell->GetReferencedCells()) {
-                cells_to_check.push_back(cell_);
-            }
+        runs.cells.push_back(entry.pos);
+    }
+    runs.runs.push_back(runs.cells.size());
+//A single cell is calculated as usual
+    for (size_t index = 0; index < runs.formulas.size(); ++index) {
+        if (runs.runs[index + 1] - runs.runs[index] == 1) {
+            runs.formulas[index] = nullptr;
         }
-        cells_to_check.erase(cells_to_check.begin());
     }
+    return runs;
+}
+
+void Sheet::CalculateRun(const SharedFormula& formula, const Position* cells, size_t count) const {
+    const std::vector<Position> positions(cells, cells + count);
+    std::vector<FormulaInterface::Value> values;
+    formula.EvaluateBatch(*this, positions, values);
+    for (size_t index = 0; index < count; ++index) {
+        sheet_.Get(positions[index])->CacheValue(values[index]);
+    }
+}
+
+ThreadPool& Sheet::GetPool(size_t threads) {
+    const size_t thread_count = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    if (!pool_ || pool_->GetThreadCount() != thread_count) {
+        pool_ = std::make_unique<ThreadPool>(thread_count);
+    }
+    return *pool_;
+}
+
+std::unique_ptr<SheetInterface> CreateSheet() {
+    return std::make_unique<Sheet>();
 }
@@ -2,9 +2,16 @@
 
 #include "cell.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "object_pool.h"
+#include "persistent_tiled_storage.h"
+#include "sheet_stats.h"
+#include "thread_pool.h"
+#include "tiled_storage.h"
 
-#include <unordered_map>
 #include <functional>
+#include <string>
+#include <utility>
 #include <vector>
 
 
@@ -14,10 +21,15 @@ public:
  
     void SetCell(Position pos, std::string text) override;
 
+    void SetCells(const std::vector<std::pair<Position, std::string>>& cells, size_t threads = 0) override;
+
     const CellInterface* GetCell(Position pos) const override;
     
     CellInterface* GetCell(Position pos) override;
 
+    void ForEachCellInRange(CellRange range,
+                            const std::function<void(Position, const CellInterface&)>& func) const override;
+
     void ClearCell(Position pos) override;
 
     Size GetPrintableSize() const override;
@@ -25,19 +37,110 @@ public:
     void PrintValues(std::ostream& output) const override;
 
     void PrintTexts(std::ostream& output) const override;
+
+    void Recalculate(size_t threads = 0) override;
+
+    std::shared_ptr<const SheetInterface> Snapshot() override;
+
+//The counters of the sheet; they may be read on any thread, even while
+//the sheet is modified or recalculated
+    SheetStats GetStats() const;
+
+//Walks all the cells, so it takes time proportional to their number
+    SheetMemoryUsage MemoryUsage() const;
+
+//The cells count the reads of their values and the parsed formulas here
+    SheetCounters& GetCounters() const {
+        return counters_;
+    }
     
 private:
-    void CycleDependencyFound(CellInterface* tmp_cell, Position pos);
+    std::vector<DependencyGraph::NodeId> SafeGetRefNodes(const std::vector<Position>& ref_cells);
 
-    void SafeAddDependForRefCells(CellInterface* depend_cell, Position pos);
+//A cell of SetCells() on its way into the sheet
+    struct CellEdit {
+        Position pos;
+        const std::string* text = nullptr;
+        //the slot of the pool the cell is built in
+        void* slot = nullptr;
+        ObjectPool<Cell>::Pointer cell;
+        FormulaReferences references;
+        //the references to the cells that did not exist, linked to their
+        //placeholders once the edits are in the sheet
+        std::vector<Position> missing_references;
+        DependencyGraph::NodeId node = 0;
+        bool is_new = false;
+        std::vector<DependencyGraph::NodeId> old_ref_nodes;
+        std::vector<CellRange> old_ranges;
+    };
 
-    Size ComputePrintSize() const;
-    
-    struct HashSheet {
-        size_t operator()(Position pos) const {
-            return pos.row*39 + (pos.col)*39*39;
-        }
+//Checks the references of all the edits for cycles at once and links them in
+//the graph; on CircularDependencyException the graph is left unchanged
+    void LinkEdits(std::vector<CellEdit>& edits);
+
+//Resets the cached values of all cells that depend on the nodes
+    void ResetDependentsCache(const std::vector<DependencyGraph::NodeId>& nodes);
+
+    ThreadPool& GetPool(size_t threads);
+
+//The cells of a level of Recalculate() ordered so that the cells sharing
+//a formula in consecutive rows of a column are next to each other
+    struct LevelRuns {
+        std::vector<Position> cells;
+        //runs[i] is the first cell of the i-th run, the last entry is the end
+        std::vector<size_t> runs;
+        //the shared formula of every run, nullptr for a single cell
+        std::vector<const SharedFormula*> formulas;
     };
 
-    std::unordered_map<Position, std::unique_ptr<Cell>, HashSheet> sheet_;
+    LevelRuns SplitIntoRuns(const std::vector<DependencyGraph::NodeId>& level) const;
+
+//Calculates a run of cells sharing a formula with one EvaluateBatch() call
+    void CalculateRun(const SharedFormula& formula, const Position* cells, size_t count) const;
+
+    Cell* GetNodeCell(DependencyGraph::NodeId node) const;
+
+//Mirrors the content of the cell at pos into contents_
+    void UpdateContents(Position pos);
+
+//Remembers the node with the reset value for Recalculate()
+    void MarkDirty(DependencyGraph::NodeId node);
+
+//Is the node still in the graph and its cell waiting for calculation
+    bool IsDirty(DependencyGraph::NodeId node) const;
+
+//Keeps the printable area up to date when the cell at pos
+//turns from empty into non-empty or back
+    void UpdatePrintableSize(Position pos, bool was_printable, bool is_printable);
+
+//The cells are allocated from the pool, so the cleared and replaced cells
+//are recycled; it is declared first to outlive them
+    ObjectPool<Cell> cell_pool_;
+    TiledStorage<Cell, ObjectPool<Cell>::Deleter> sheet_{ObjectPool<Cell>::Deleter{&cell_pool_}};
+    DependencyGraph graph_;
+
+//Number of non-empty cells in every row and column,
+//printable_size_ is the bounding rectangle of them
+    std::vector<int> row_occupancy_ = std::vector<int>(Position::MAX_ROWS);
+    std::vector<int> col_occupancy_ = std::vector<int>(Position::MAX_COLS);
+    Size printable_size_;
+
+//New cells are ordered after all the others, empty placeholders are ordered
+//before all the others (they reference nothing), so setting a new cell
+//rarely needs the order to be restored
+    int64_t next_order_ = 0;
+    int64_t next_placeholder_order_ = -1;
+
+//Nodes reset since the last Recalculate(), may contain removed nodes
+//and the ones calculated on demand since then; a node is listed once
+    std::vector<DependencyGraph::NodeId> dirty_nodes_;
+    std::vector<bool> listed_dirty_;
+    std::unique_ptr<ThreadPool> pool_;
+
+//Contents of the cells shared with the snapshots. They are mirrored only
+//after the first snapshot, so sheets without snapshots do not pay for it
+    PersistentTiledStorage<Cell::Impl> contents_;
+    bool contents_tracked_ = false;
+
+    mutable SheetCounters counters_;
 };
\ No newline at end of file
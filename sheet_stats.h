@@ -0,0 +1,125 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Cumulative counters of the work done by a sheet since it was created
+struct SheetStats {
+    // values reset because a cell they depend on changed
+    uint64_t cells_invalidated = 0;
+    // formula values read from the cache of the cell and calculated
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    // formula texts parsed, the ones found in the FormulaCache are not counted
+    uint64_t formulas_parsed = 0;
+    // nodes visited by the cycle checks of the dependency graph
+    uint64_t cycle_check_nodes = 0;
+    // empty cells created for the references to cells that did not exist
+    uint64_t placeholders_created = 0;
+
+    // Bytes allocated by every subsystem: the cells with their contents,
+    // the dependency graph and the tiles of the cell storage. The sizes of
+    // the stored elements are counted, the spare capacity of vectors is not
+    uint64_t cell_bytes = 0;
+    uint64_t graph_bytes = 0;
+    uint64_t storage_bytes = 0;
+};
+
+// The bytes a sheet holds now, by what they are used for. The sizes of the
+// objects and of the vector capacities are summed, the overhead of the heap
+// allocator is not counted
+struct SheetMemoryUsage {
+    // the tiles of the cells, of the contents shared with the snapshots and
+    // the bookkeeping of the printable area
+    size_t storage = 0;
+    // the Cell objects without their cached values
+    size_t cells = 0;
+    // the contents of the cells: the text and formula objects
+    size_t impls = 0;
+    // the parsed formulas, a formula shared by several cells is counted once;
+    // the formulas may be shared with other sheets through the FormulaCache
+    size_t formulas = 0;
+    // the dependency graph: the nodes, the edges and the indexes
+    size_t dependencies = 0;
+    // the cached values of the cells and the list of the cells to recalculate
+    size_t caches = 0;
+    // the characters of the texts that do not fit into the string objects
+    size_t strings = 0;
+
+    size_t Total() const {
+        return storage + cells + impls + formulas + dependencies + caches + strings;
+    }
+};
+
+// The counters of SheetStats kept by the sheet and its cells; the dependency
+// graph and the cell storage keep their own. They are relaxed atomics, so they
+// are cheap enough to be always on and may be read on any thread while the
+// sheet is changed or read; the counters of one Load() need not be consistent
+// with each other.
+class SheetCounters {
+public:
+    using Counter = std::atomic<uint64_t>;
+
+    // A counter added to by every read of a formula value, by all the threads
+    // of Recalculate() at once. Every thread adds to its own shard on its own
+    // cache line, so the readers do not contend for one line; Load() sums them
+    class ShardedCounter {
+    public:
+        void Add(uint64_t value) {
+            shards_[ShardIndex()].value.fetch_add(value, std::memory_order_relaxed);
+        }
+
+        uint64_t Load() const {
+            uint64_t sum = 0;
+            for (const Shard& shard : shards_) {
+                sum += shard.value.load(std::memory_order_relaxed);
+            }
+            return sum;
+        }
+
+    private:
+        static constexpr size_t SHARDS = 16;
+        static constexpr size_t CACHE_LINE_SIZE = 64;
+
+        struct alignas(CACHE_LINE_SIZE) Shard {
+            Counter value{0};
+        };
+
+        // The threads take the shards in turn, the same for all the sheets
+        static size_t ShardIndex() {
+            static std::atomic<size_t> next_thread{0};
+            thread_local const size_t index = next_thread.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+            return index;
+        }
+
+        std::array<Shard, SHARDS> shards_;
+    };
+
+    static void Add(Counter& counter, uint64_t value = 1) {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    static void Add(ShardedCounter& counter, uint64_t value = 1) {
+        counter.Add(value);
+    }
+
+    SheetStats Load() const {
+        SheetStats stats;
+        stats.cells_invalidated = cells_invalidated.load(std::memory_order_relaxed);
+        stats.cache_hits = cache_hits.Load();
+        stats.cache_misses = cache_misses.Load();
+        stats.formulas_parsed = formulas_parsed.load(std::memory_order_relaxed);
+        stats.placeholders_created = placeholders_created.load(std::memory_order_relaxed);
+        stats.cell_bytes = cell_bytes.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    Counter cells_invalidated{0};
+    ShardedCounter cache_hits;
+    ShardedCounter cache_misses;
+    Counter formulas_parsed{0};
+    Counter placeholders_created{0};
+    Counter cell_bytes{0};
+};
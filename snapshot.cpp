@@ -0,0 +1,151 @@
+#include "snapshot.h"
+
+#include "buffered_output.h"
+
+#include <stdexcept>
+#include <utility>
+
+class SnapshotCell : public CellInterface {
+public:
+    SnapshotCell(const SheetInterface& sheet, const Cell::Impl& impl)
+        : sheet_(sheet)
+        , impl_(impl) {
+    }
+
+    Value GetValue() const override {
+        return impl_.GetValue(sheet_, cache_);
+    }
+
+    ValueView GetValueView() const override {
+        return impl_.GetValueView(sheet_, cache_);
+    }
+
+    std::string GetText() const override {
+        return impl_.GetText();
+    }
+
+    NumericValue GetNumericValue() const override {
+        return impl_.GetNumericValue(sheet_, cache_);
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        return impl_.GetReferencedCells();
+    }
+
+private:
+    const SheetInterface& sheet_;
+    //The content is kept alive by the contents of the snapshot
+    const Cell::Impl& impl_;
+    CachedValue cache_;
+};
+
+namespace {
+//Readers racing to create the same object all get the one
+//that was stored first, the others are deleted
+template <typename T, typename Create>
+T* GetOrCreate(std::atomic<T*>& slot, Create create) {
+    T* value = slot.load(std::memory_order_acquire);
+    if (value) {
+        return value;
+    }
+    std::unique_ptr<T> created = create();
+    if (slot.compare_exchange_strong(value, created.get(), std::memory_order_acq_rel,
+                                     std::memory_order_acquire)) {
+        return created.release();
+    }
+    return value;
+}
+}  // namespace
+
+SheetSnapshot::CellTile::~CellTile() {
+    for (auto& cell : cells) {
+        delete cell.load(std::memory_order_relaxed);
+    }
+}
+
+SheetSnapshot::CellTileRow::~CellTileRow() {
+    for (auto& tile : tiles) {
+        delete tile.load(std::memory_order_relaxed);
+    }
+}
+
+SheetSnapshot::SheetSnapshot(Contents contents, Size printable_size)
+    : contents_(std::move(contents))
+    , printable_size_(printable_size) {
+}
+
+SheetSnapshot::~SheetSnapshot() {
+    for (auto& tile_row : cell_rows_) {
+        delete tile_row.load(std::memory_order_relaxed);
+    }
+}
+
+void SheetSnapshot::SetCell(Position, std::string) {
+    throw std::logic_error("Trying SetCell on a read-only snapshot");
+}
+
+void SheetSnapshot::SetCells(const std::vector<std::pair<Position, std::string>>&, size_t) {
+    throw std::logic_error("Trying SetCells on a read-only snapshot");
+}
+
+void SheetSnapshot::ClearCell(Position) {
+    throw std::logic_error("Trying ClearCell on a read-only snapshot");
+}
+
+const CellInterface* SheetSnapshot::GetCell(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Trying GetCell with Invalid position");
+    }
+    if (!contents_.Get(pos)) {
+        return nullptr;
+    }
+    return GetOrCreateCell(pos);
+}
+
+CellInterface* SheetSnapshot::GetCell(Position pos) {
+//The snapshot cells have only const methods
+    return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
+}
+
+void SheetSnapshot::ForEachCellInRange(CellRange range,
+                                       const std::function<void(Position, const CellInterface&)>& func) const {
+    contents_.ForEachInRange(range, [this, &func](Position pos, const Cell::Impl&) {
+        func(pos, *GetOrCreateCell(pos));
+    });
+}
+
+Size SheetSnapshot::GetPrintableSize() const {
+    return printable_size_;
+}
+
+void SheetSnapshot::PrintValues(std::ostream& output) const {
+    PrintArea(contents_, printable_size_, output, [this](Position pos, const Cell::Impl&, BufferedOutput& out) {
+        std::visit([&out](const auto& value) { out.Put(value); }, GetOrCreateCell(pos)->GetValueView());
+    });
+}
+
+void SheetSnapshot::PrintTexts(std::ostream& output) const {
+    PrintArea(contents_, printable_size_, output, [](Position, const Cell::Impl& impl, BufferedOutput& out) {
+        out.Put(impl.GetText());
+    });
+}
+
+void SheetSnapshot::Recalculate(size_t) {
+}
+
+std::shared_ptr<const SheetInterface> SheetSnapshot::Snapshot() {
+    return std::make_shared<SheetSnapshot>(contents_, printable_size_);
+}
+
+const SnapshotCell* SheetSnapshot::GetOrCreateCell(Position pos) const {
+    CellTileRow* tile_row = GetOrCreate(cell_rows_[pos.row / TILE_SIZE], [] {
+        return std::make_unique<CellTileRow>();
+    });
+    CellTile* tile = GetOrCreate(tile_row->tiles[pos.col / TILE_SIZE], [] {
+        return std::make_unique<CellTile>();
+    });
+    const int slot = (pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE;
+    return GetOrCreate(tile->cells[slot], [this, pos] {
+        return std::make_unique<SnapshotCell>(*this, *contents_.Get(pos));
+    });
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+#include "persistent_tiled_storage.h"
+
+#include <array>
+#include <atomic>
+#include <memory>
+
+class SnapshotCell;
+
+// Read-only state of a sheet at the moment Sheet::Snapshot() was called.
+// The contents of the cells are shared with the sheet and the other snapshots,
+// the values are calculated and cached by every snapshot on its own, since
+// the same content may have other values in another state of the sheet.
+// The cell objects of the snapshot are created on the first access to them,
+// any number of threads may read the snapshot at once.
+class SheetSnapshot : public SheetInterface {
+public:
+    using Contents = PersistentTiledStorage<Cell::Impl>;
+
+    SheetSnapshot(Contents contents, Size printable_size);
+
+    SheetSnapshot(const SheetSnapshot&) = delete;
+    SheetSnapshot& operator=(const SheetSnapshot&) = delete;
+
+    ~SheetSnapshot() override;
+
+    // The snapshot cannot be changed, these methods throw std::logic_error
+    void SetCell(Position pos, std::string text) override;
+    void SetCells(const std::vector<std::pair<Position, std::string>>& cells, size_t threads = 0) override;
+    void ClearCell(Position pos) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ForEachCellInRange(CellRange range,
+                            const std::function<void(Position, const CellInterface&)>& func) const override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    // The values of the snapshot are calculated on demand, nothing to do
+    void Recalculate(size_t threads = 0) override;
+
+    // Another view of the same state with its own cached values
+    std::shared_ptr<const SheetInterface> Snapshot() override;
+
+private:
+    static constexpr int TILE_SIZE = Contents::TILE_SIZE;
+
+    struct CellTile {
+        std::array<std::atomic<SnapshotCell*>, TILE_SIZE * TILE_SIZE> cells{};
+        ~CellTile();
+    };
+
+    struct CellTileRow {
+        std::array<std::atomic<CellTile*>, Contents::TILE_COLS> tiles{};
+        ~CellTileRow();
+    };
+
+    const SnapshotCell* GetOrCreateCell(Position pos) const;
+
+    Contents contents_;
+    Size printable_size_;
+    mutable std::array<std::atomic<CellTileRow*>, Contents::TILE_ROWS> cell_rows_{};
+};
@@ -78,6 +78,29 @@ bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
 
+bool CellRange::operator==(CellRange rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool CellRange::operator<(CellRange rhs) const {
+    return std::tie(first, last) < std::tie(rhs.first, rhs.last);
+}
+
+bool CellRange::IsValid() const {
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+bool CellRange::Contains(Position pos) const {
+    return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col && pos.col <= last.col;
+}
+
+std::string CellRange::ToString() const {
+    if (!IsValid()) {
+        return "";
+    }
+    return first.ToString() + ':' + last.ToString();
+}
+
 FormulaError::FormulaError(Category category)
     : category_(category) {
 }
@@ -0,0 +1,109 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+//Indices are taken in chunks, so the workers do not fight
+//over the counters when the items are cheap
+constexpr size_t CHUNK_SIZE = 32;
+}  // namespace
+
+ThreadPool::ThreadPool(size_t threads)
+    : parts_(threads ? threads : std::max<size_t>(1, std::thread::hardware_concurrency())) {
+//The calling thread is the worker 0
+    threads_.reserve(parts_.size() - 1);
+    for (size_t worker = 1; worker < parts_.size(); ++worker) {
+        threads_.emplace_back([this, worker] { WorkerLoop(worker); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard guard(mutex_);
+        stopping_ = true;
+    }
+    start_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& func) {
+    if (count == 0) {
+        return;
+    }
+    if (threads_.empty() || count <= CHUNK_SIZE) {
+        for (size_t index = 0; index < count; ++index) {
+            func(index);
+        }
+        return;
+    }
+
+    const size_t workers = parts_.size();
+    for (size_t worker = 0; worker < workers; ++worker) {
+        parts_[worker].next.store(count * worker / workers, std::memory_order_relaxed);
+        parts_[worker].end = count * (worker + 1) / workers;
+    }
+    {
+        std::lock_guard guard(mutex_);
+        func_ = &func;
+        error_ = nullptr;
+        running_ = threads_.size();
+        ++generation_;
+    }
+    start_.notify_all();
+
+    RunLoop(0);
+
+    std::unique_lock lock(mutex_);
+    finish_.wait(lock, [this] { return running_ == 0; });
+    func_ = nullptr;
+    if (error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+void ThreadPool::WorkerLoop(size_t worker) {
+    size_t seen_generation = 0;
+    while (true) {
+        {
+            std::unique_lock lock(mutex_);
+            start_.wait(lock, [&] { return stopping_ || generation_ != seen_generation; });
+            if (stopping_) {
+                return;
+            }
+            seen_generation = generation_;
+        }
+        RunLoop(worker);
+        std::lock_guard guard(mutex_);
+        if (--running_ == 0) {
+            finish_.notify_one();
+        }
+    }
+}
+
+void ThreadPool::RunLoop(size_t worker) {
+    const size_t workers = parts_.size();
+    try {
+//The own part first, then stealing from the others
+        for (size_t shift = 0; shift < workers; ++shift) {
+            Part& part = parts_[(worker + shift) % workers];
+            while (true) {
+                const size_t begin = part.next.fetch_add(CHUNK_SIZE, std::memory_order_relaxed);
+                if (begin >= part.end) {
+                    break;
+                }
+                const size_t end = std::min(begin + CHUNK_SIZE, part.end);
+                for (size_t index = begin; index < end; ++index) {
+                    (*func_)(index);
+                }
+            }
+        }
+    } catch (...) {
+        std::lock_guard guard(mutex_);
+        if (!error_) {
+            error_ = std::current_exception();
+        }
+    }
+}
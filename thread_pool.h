@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running parallel loops.
+// The index range of a loop is split evenly between the workers (the calling
+// thread is one of them). A worker takes small chunks from its own part, and
+// when the part is exhausted it steals chunks from the parts of the others,
+// so a worker with cheap items helps the ones with expensive items.
+class ThreadPool {
+public:
+    // Zero means one worker per hardware thread
+    explicit ThreadPool(size_t threads = 0);
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool();
+
+    size_t GetThreadCount() const {
+        return parts_.size();
+    }
+
+    // Calls func(index) for every index in [0, count) and waits for all the calls.
+    // The first exception thrown by func is rethrown here.
+    void ParallelFor(size_t count, const std::function<void(size_t)>& func);
+
+private:
+    struct alignas(64) Part {
+        std::atomic<size_t> next{0};
+        size_t end = 0;
+    };
+
+    void WorkerLoop(size_t worker);
+
+    void RunLoop(size_t worker);
+
+    std::vector<Part> parts_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable finish_;
+    const std::function<void(size_t)>* func_ = nullptr;
+    size_t generation_ = 0;
+    size_t running_ = 0;
+    bool stopping_ = false;
+    std::exception_ptr error_;
+};
@@ -0,0 +1,260 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace tiled_storage_detail {
+
+inline int CountTrailingZeros(uint64_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+}  // namespace tiled_storage_detail
+
+// Sparse storage of the sheet cells.
+// The sheet area is split into TILE_SIZE x TILE_SIZE tiles. A tile is allocated
+// when the first value is put into it and released when the last one is taken out.
+// Slots inside a tile are dense and row-major, so any lookup is two array
+// indexations and a row scan touches memory in order.
+// The values are passed in and out as unique_ptr<T, Deleter>, so they may
+// come from an ObjectPool; the slots keep plain pointers and the storage
+// keeps one deleter for all of them.
+template <typename T, typename Deleter = std::default_delete<T>>
+class TiledStorage {
+public:
+    using Pointer = std::unique_ptr<T, Deleter>;
+
+    static constexpr int TILE_SIZE = 64;
+    static constexpr int TILE_ROWS = Position::MAX_ROWS / TILE_SIZE;
+    static constexpr int TILE_COLS = Position::MAX_COLS / TILE_SIZE;
+
+    explicit TiledStorage(Deleter deleter = Deleter())
+        : deleter_(std::move(deleter)) {
+    }
+
+    TiledStorage(const TiledStorage&) = delete;
+    TiledStorage& operator=(const TiledStorage&) = delete;
+
+    ~TiledStorage() {
+        ForEach([this](Position, T& value) {
+            deleter_(&value);
+        });
+    }
+
+    // Returns the stored value or nullptr if the slot is empty.
+    // The position must be valid.
+    T* Get(Position pos) const {
+        const Tile* tile = FindTile(pos);
+        if (!tile) {
+            return nullptr;
+        }
+        return tile->slots[SlotIndex(pos)];
+    }
+
+    bool Contains(Position pos) const {
+        return Get(pos) != nullptr;
+    }
+
+    // Puts the value into the slot and returns the previous one
+    Pointer Put(Position pos, Pointer value) {
+        if (!value) {
+            return Take(pos);
+        }
+        Tile& tile = GetOrCreateTile(pos);
+        T*& slot = tile.slots[SlotIndex(pos)];
+        if (!slot) {
+            tile.row_masks[pos.row % TILE_SIZE] |= ColumnBit(pos);
+            ++tile.count;
+            ++size_;
+        }
+        return Pointer(std::exchange(slot, value.release()), deleter_);
+    }
+
+    // Takes the value out of the slot (nullptr if the slot is empty).
+    // A tile left without values is released.
+    Pointer Take(Position pos) {
+        auto& tile_row = rows_[pos.row / TILE_SIZE];
+        if (!tile_row) {
+            return nullptr;
+        }
+        auto& tile = tile_row->tiles[pos.col / TILE_SIZE];
+        if (!tile) {
+            return nullptr;
+        }
+        Pointer value(std::exchange(tile->slots[SlotIndex(pos)], nullptr), deleter_);
+        if (!value) {
+            return nullptr;
+        }
+        tile->row_masks[pos.row % TILE_SIZE] &= ~ColumnBit(pos);
+        --size_;
+        if (--tile->count == 0) {
+            tile.reset();
+            if (--tile_row->tile_count == 0) {
+                tile_row.reset();
+            }
+        }
+        return value;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    // Bytes allocated for the tiles since the storage was created, the
+    // released tiles included; the stored values are not counted
+    uint64_t GetAllocatedBytes() const {
+        return allocated_bytes_.load(std::memory_order_relaxed);
+    }
+
+    // Bytes of the storage and its tiles now; the stored values are not counted
+    size_t GetMemoryUsage() const {
+        size_t bytes = sizeof(*this);
+        for (const auto& tile_row : rows_) {
+            if (tile_row) {
+                bytes += sizeof(TileRow) + tile_row->tile_count * sizeof(Tile);
+            }
+        }
+        return bytes;
+    }
+
+    // Calls func(Position, T&) for every stored value of the row in column order
+    template <typename Func>
+    void ForEachInRow(int row, Func&& func) const {
+        const auto& tile_row = rows_[row / TILE_SIZE];
+        if (!tile_row) {
+            return;
+        }
+        const int row_in_tile = row % TILE_SIZE;
+        for (int tile_col = 0; tile_col < TILE_COLS; ++tile_col) {
+            const Tile* tile = tile_row->tiles[tile_col].get();
+            if (!tile) {
+                continue;
+            }
+            uint64_t mask = tile->row_masks[row_in_tile];
+            while (mask) {
+                const int col_in_tile = tiled_storage_detail::CountTrailingZeros(mask);
+                mask &= mask - 1;
+                func(Position{row, tile_col * TILE_SIZE + col_in_tile},
+                     *tile->slots[row_in_tile * TILE_SIZE + col_in_tile]);
+            }
+        }
+    }
+
+    // Calls func(Position, T&) for every stored value of the valid range
+    // in row-major order
+    template <typename Func>
+    void ForEachInRange(CellRange range, Func&& func) const {
+        const int first_tile_col = range.first.col / TILE_SIZE;
+        const int last_tile_col = range.last.col / TILE_SIZE;
+        for (int row = range.first.row; row <= range.last.row; ++row) {
+            const auto& tile_row = rows_[row / TILE_SIZE];
+            if (!tile_row) {
+                // the rest of the rows of the tile are empty too
+                row = (row / TILE_SIZE + 1) * TILE_SIZE - 1;
+                continue;
+            }
+            const int row_in_tile = row % TILE_SIZE;
+            for (int tile_col = first_tile_col; tile_col <= last_tile_col; ++tile_col) {
+                const Tile* tile = tile_row->tiles[tile_col].get();
+                if (!tile) {
+                    continue;
+                }
+                uint64_t mask = tile->row_masks[row_in_tile];
+                if (tile_col == first_tile_col) {
+                    mask &= ~uint64_t{0} << (range.first.col % TILE_SIZE);
+                }
+                if (tile_col == last_tile_col) {
+                    mask &= ~uint64_t{0} >> (TILE_SIZE - 1 - range.last.col % TILE_SIZE);
+                }
+                while (mask) {
+                    const int col_in_tile = tiled_storage_detail::CountTrailingZeros(mask);
+                    mask &= mask - 1;
+                    func(Position{row, tile_col * TILE_SIZE + col_in_tile},
+                         *tile->slots[row_in_tile * TILE_SIZE + col_in_tile]);
+                }
+            }
+        }
+    }
+
+    // Calls func(Position, T&) for every stored value in row-major order
+    template <typename Func>
+    void ForEach(Func&& func) const {
+        for (int tile_row = 0; tile_row < TILE_ROWS; ++tile_row) {
+            if (!rows_[tile_row]) {
+                continue;
+            }
+            for (int row = tile_row * TILE_SIZE; row < (tile_row + 1) * TILE_SIZE; ++row) {
+                ForEachInRow(row, func);
+            }
+        }
+    }
+
+private:
+    struct Tile {
+        std::array<T*, TILE_SIZE * TILE_SIZE> slots{};
+        // bit N of row_masks[R] is set when the slot (R, N) holds a value
+        std::array<uint64_t, TILE_SIZE> row_masks{};
+        int count = 0;
+    };
+
+    struct TileRow {
+        std::array<std::unique_ptr<Tile>, TILE_COLS> tiles;
+        int tile_count = 0;
+    };
+
+    static int SlotIndex(Position pos) {
+        return (pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE;
+    }
+
+    static uint64_t ColumnBit(Position pos) {
+        return uint64_t{1} << (pos.col % TILE_SIZE);
+    }
+
+    const Tile* FindTile(Position pos) const {
+        const auto& tile_row = rows_[pos.row / TILE_SIZE];
+        if (!tile_row) {
+            return nullptr;
+        }
+        return tile_row->tiles[pos.col / TILE_SIZE].get();
+    }
+
+    Tile& GetOrCreateTile(Position pos) {
+        auto& tile_row = rows_[pos.row / TILE_SIZE];
+        if (!tile_row) {
+            tile_row = std::make_unique<TileRow>();
+            allocated_bytes_.fetch_add(sizeof(TileRow), std::memory_order_relaxed);
+        }
+        auto& tile = tile_row->tiles[pos.col / TILE_SIZE];
+        if (!tile) {
+            tile = std::make_unique<Tile>();
+            ++tile_row->tile_count;
+            allocated_bytes_.fetch_add(sizeof(Tile), std::memory_order_relaxed);
+        }
+        return *tile;
+    }
+
+    std::array<std::unique_ptr<TileRow>, TILE_ROWS> rows_;
+    size_t size_ = 0;
+    Deleter deleter_;
+    // may be read on other threads while the storage is changed
+    std::atomic<uint64_t> allocated_bytes_{0};
+};